@@ -389,6 +389,15 @@ function genJmpTables(spec: Spec) {
     }
     r += "expr_invalid\n\n"
 
+    r += "#define DEVS_OP_DISPATCH(X) X(0, expr_invalid) \\\n"
+    for (const obj of sortByCode(spec.ops)) {
+        const name = obj.name.startsWith("removed_")
+            ? "expr_invalid"
+            : `${sig(obj).toLowerCase()}_${obj.name}`
+        r += `X(${obj.code}, ${name}) \\\n`
+    }
+    r += "\n\n"
+
     return r
 }
 
@@ -88,6 +88,8 @@ const DEVS_TRACE_EV_BROADCAST_PACKET = 0x44
 const DEVS_TRACE_EV_ROLE_CHANGED = 0x45
 const DEVS_TRACE_EV_FIBER_RUN = 0x46
 const DEVS_TRACE_EV_FIBER_YIELD = 0x47
+const DEVS_TRACE_EV_FIBER_STATS = 0x48
+const DEVS_TRACE_EV_REGCACHE_STATS = 0x49
 
 const typeLookup: Record<number, string> = {
     [JD_LSTORE_TYPE_DEVINFO]: "devinfo",
@@ -103,6 +105,8 @@ const typeLookup: Record<number, string> = {
     [DEVS_TRACE_EV_ROLE_CHANGED]: "ROLE",
     [DEVS_TRACE_EV_FIBER_RUN]: "FIBER_RUN",
     [DEVS_TRACE_EV_FIBER_YIELD]: "FIBER_YIELD",
+    [DEVS_TRACE_EV_FIBER_STATS]: "FIBER_STATS",
+    [DEVS_TRACE_EV_REGCACHE_STATS]: "REGCACHE_STATS",
 }
 
 export class GenerationInfo {
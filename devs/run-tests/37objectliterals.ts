@@ -55,6 +55,66 @@ function computedPropNames() {
     check(o, "f:10,cx:12,1:x,3:b123")
 }
 
+class ZHolder {
+    z = 5
+}
+
+function getZ(o: any) {
+    return o.z
+}
+
+function fieldCacheTest() {
+    msg("fieldCacheTest")
+    // same read site, different key layouts
+    const objs: any[] = [
+        { z: 1 },
+        { a: 0, z: 2 },
+        { a: 0, b: 0, z: 3 },
+        { a: 0, z: 4 },
+    ]
+    let sum = 0
+    for (let i = 0; i < 3; ++i) for (const o of objs) sum += getZ(o)
+    assert(sum === 30)
+
+    const o = objs[1]
+    delete o.a
+    assert(getZ(o) === 2)
+    delete o.z
+    assert(getZ(o) === undefined)
+    assert(getZ(new ZHolder()) === 5)
+}
+
+function shapeTest() {
+    msg("shapeTest")
+    const objs: any[] = []
+    for (let i = 0; i < 5; ++i) {
+        const o: any = {}
+        o.a = i
+        o.b = i + 1
+        if (i & 1) o.c = "odd"
+        objs.push(o)
+    }
+    check(objs[2], "a:2,b:3")
+    check(objs[3], "a:3,b:4,c:odd")
+    objs[3].a = 7
+    delete objs[3].b
+    check(objs[3], "a:7,c:odd")
+    check(objs[1], "a:1,b:2,c:odd")
+
+    // large objects and computed keys
+    const big: any = {}
+    let exp = ""
+    for (let i = 0; i < 40; ++i) {
+        big["k" + i] = i
+        if (exp) exp += ","
+        exp += "k" + i + ":" + i
+    }
+    check(big, exp)
+    assert(big.k17 === 17)
+    assert(big["k3" + "9"] === 39)
+    assert(big.k40 === undefined)
+}
+
 function shorthandTest() {
     msg("shorthandTest")
     const x = 12
@@ -126,6 +186,8 @@ function runObjLit() {
     */
 
     deleteTest()
+    fieldCacheTest()
+    shapeTest()
     shorthandTest()
     computedPropNames()
 
@@ -18,3 +18,12 @@ expectError(RangeError, () => {
 expectError(TypeError, () => {
     const r2 = new ds.Button(12 as any)
 })
+
+r1.setSendRate(10)
+r1.setSendRate(0, 1)
+expectError(RangeError, () => {
+    r1.setSendRate(-1)
+})
+expectError(RangeError, () => {
+    r1.setSendRate(10, 0)
+})
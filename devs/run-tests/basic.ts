@@ -817,6 +817,52 @@ function testClosurePP() {
     ds.assert(idx === 3)
 }
 
+function testFrameEscape() {
+    // closures created at different depths, some past the end of the frame stack
+    const fns: (() => number)[] = []
+    function rec(n: number): number {
+        let local = n * 2
+        fns.push(() => local + n)
+        if (n > 0) local += rec(n - 1)
+        return local
+    }
+    ds.assert(rec(60) === 3660)
+    ds.assert(fns.length === 61)
+    ds.assert(fns[0]() === 3720)
+    ds.assert(fns[60]() === 0)
+    ds.assert(fns[59]() === 3)
+}
+
+function testTailCalls() {
+    // way past DEVS_MAX_CALL_DEPTH
+    function sum(n: number, acc: number): number {
+        if (n === 0) return acc
+        return sum(n - 1, acc + n)
+    }
+    ds.assert(sum(1000, 0) === 500500)
+
+    function isEven(n: number): boolean {
+        if (n === 0) return true
+        return isOdd(n - 1)
+    }
+    function isOdd(n: number): boolean {
+        if (n === 0) return false
+        return isEven(n - 1)
+    }
+    ds.assert(isEven(501) === false)
+    ds.assert(isOdd(501) === true)
+
+    class Counter {
+        n = 0
+        step(k: number): number {
+            if (k === 0) return this.n
+            this.n++
+            return this.step(k - 1)
+        }
+    }
+    ds.assert(new Counter().step(300) === 300)
+}
+
 async function testSetTimeout() {
     let q = 1
     let id = 0
@@ -929,6 +975,72 @@ async function testFibers() {
     console.log("fibers OK!")
 }
 
+async function testManyFibers() {
+    const woke: number[] = []
+    async function sleeper(ms: number) {
+        await ds.sleep(ms)
+        woke.push(ms)
+    }
+    for (let k = 0; k < 100; ++k) sleeper.start(((k * 37) % 20) * 5)
+    await ds.sleep(150)
+    ds.assert(woke.length === 100)
+    for (let k = 1; k < woke.length; ++k) ds.assert(woke[k - 1] <= woke[k])
+}
+
+async function testFiberStats() {
+    const arr: number[] = []
+    async function worker() {
+        for (let i = 0; i < 100; ++i) arr.push(i)
+        await ds.sleep(20)
+        await ds.sleep(100)
+    }
+    const f = worker.start()
+    // the first sleep is accounted for once the worker wakes up from it
+    await ds.sleep(50)
+    const st = f.stats
+    ds.assert(st.steps > 100)
+    ds.assert(st.allocated > 0)
+    ds.assert(st.waitSleep >= 20)
+    ds.assert(ds.Fiber.self().stats.steps > 0)
+    f.terminate()
+}
+
+async function testFiberPriority() {
+    const order: string[] = []
+    async function bg(name: string) {
+        order.push(name)
+    }
+    const lo = bg.start("lo")
+    const hi = bg.start("hi")
+    ds.assert(lo.priority === 1)
+    lo.setPriority(0)
+    hi.setPriority(2)
+    ds.assert(lo.priority === 0 && hi.priority === 2)
+    await ds.sleep(5)
+    ds.assert(order.join() === "hi,lo")
+    let err = false
+    try {
+        ds.Fiber.self().setPriority(3)
+    } catch {
+        err = true
+    }
+    ds.assert(err)
+}
+
+async function testPreempt() {
+    let ticks = 0
+    async function ticker() {
+        ticks++
+    }
+
+    ticker.start()
+    // long enough to be preempted a few times, but without sleeping
+    let n = 0
+    for (let i = 0; i < 100000; ++i) n = (n + i) & 0xffff
+    ds.assert(n === 0x2eb0)
+    ds.assert(ticks === 1)
+}
+
 class FooError extends Error {}
 
 function testCtorError() {
@@ -1230,11 +1342,17 @@ testBuiltinExtends()
 testUndef()
 testDestructArg()
 testClosurePP()
+testFrameEscape()
+testTailCalls()
 testShift()
 await testSetTimeout()
 testRest()
 const s = new SuiteNode()
 await testFibers()
+await testManyFibers()
+await testFiberStats()
+await testFiberPriority()
+await testPreempt()
 testCtorError()
 testIgnoredAnd()
 testQDot()
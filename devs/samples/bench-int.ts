@@ -0,0 +1,40 @@
+import * as ds from "@devicescript/core"
+
+// integer-heavy loops; run with runtime/scripts/vm-bench.sh devs/samples/bench-int.ts
+
+function sumLoop(n: number) {
+    let s = 0
+    for (let i = 0; i < n; ++i) s = (s + i * 3 - (i >> 1)) & 0xffffff
+    return s
+}
+
+function fib(n: number) {
+    let a = 0
+    let b = 1
+    for (let i = 0; i < n; ++i) {
+        const t = (a + b) | 0
+        a = b
+        b = t
+    }
+    return a
+}
+
+function sieve(n: number) {
+    const flags = Buffer.alloc(n)
+    let cnt = 0
+    for (let i = 2; i < n; ++i) {
+        if (flags[i]) continue
+        cnt++
+        for (let j = i + i; j < n; j += i) flags[j] = 1
+    }
+    return cnt
+}
+
+const t0 = ds.millis()
+let r = 0
+for (let k = 0; k < 20; ++k) {
+    r += sumLoop(5000)
+    r += fib(1000)
+    r += sieve(2000)
+}
+console.log(`bench-int: ${r} in ${ds.millis() - t0}ms`)
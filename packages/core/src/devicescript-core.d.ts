@@ -74,6 +74,13 @@ declare module "@devicescript/core" {
          */
         sendCommand(serviceCommand: number, payload?: Buffer): Promise<void>
 
+        /**
+         * Limit how fast commands are sent to this role, on top of the limit for the whole program.
+         * @param packetsPerSecond sustained rate; 0 removes the per-role limit
+         * @param burst number of packets that can be sent at once, defaults to 5
+         */
+        setSendRate(packetsPerSecond: number, burst?: number): void
+
         /**
          * @internal
          * @deprecated internal field for runtime support
@@ -150,6 +157,34 @@ declare module "@devicescript/core" {
         notImplemented(): Packet
     }
 
+    export interface FiberStats {
+        /**
+         * Number of VM instructions executed.
+         */
+        steps: number
+        /**
+         * Time spent running, in microseconds.
+         */
+        runTime: number
+        /**
+         * Bytes allocated.
+         */
+        allocated: number
+        /**
+         * Number of garbage collections triggered by allocations of this fiber.
+         */
+        gcs: number
+        /**
+         * Time spent blocked, in milliseconds, by what the fiber was waiting for.
+         */
+        waitSleep: number
+        waitRegGet: number
+        waitSend: number
+        waitSendRaw: number
+        waitSuspended: number
+        waitAwaiting: number
+    }
+
     export class Fiber {
         /**
          * Unique number identifying the fiber.
@@ -161,6 +196,12 @@ declare module "@devicescript/core" {
          */
         readonly suspended: boolean
 
+        /**
+         * Resource usage of the fiber since it started.
+         * Does not include the current run of the calling fiber.
+         */
+        readonly stats: FiberStats
+
         /**
          * If the fiber is currently suspended, mark it for resumption, passing the specified value.
          * Otherwise, throw a `RangeError`.
@@ -172,6 +213,19 @@ declare module "@devicescript/core" {
          */
         terminate(): void
 
+        /**
+         * Scheduling class of the fiber: 0 (low), 1 (default) or 2 (high).
+         * Fibers started by `Function.start()` are 1; role event handlers and socket callbacks are 2.
+         */
+        readonly priority: number
+
+        /**
+         * Change the scheduling class of the fiber.
+         * Due fibers of higher classes run first, unless a lower one has been overdue for a while.
+         * @param level 0 (low), 1 (default) or 2 (high)
+         */
+        setPriority(level: number): void
+
         /**
          * Get reference to the current fiber.
          */
@@ -0,0 +1,70 @@
+import * as ds from "@devicescript/core"
+import { describe, test, expect } from "@devicescript/test"
+import { Server, startServer } from "./servercore"
+
+class RecordingRelayServer extends Server {
+    writes: boolean[] = []
+    times: number[] = []
+    constructor() {
+        super(ds.Relay.spec)
+    }
+    enabled() {
+        return this.writes.length ? this.writes[this.writes.length - 1] : false
+    }
+    set_enabled(value: boolean) {
+        this.writes.push(value)
+        this.times.push(ds.millis())
+    }
+}
+
+describe("server", () => {
+    test("packets sent from several fibers all arrive", async () => {
+        const server = new RecordingRelayServer()
+        const relay = new ds.Relay(startServer(server))
+        // wait for the role to bind
+        await relay.enabled.read()
+
+        // commands to the same device sent in one scheduler pass are packed into one frame
+        const numFibers = 3
+        const numWrites = 5
+        async function writer(k: number) {
+            for (let i = 0; i < numWrites; ++i)
+                await relay.enabled.write(((k + i) & 1) === 1)
+        }
+        for (let k = 0; k < numFibers; ++k) writer.start(k)
+
+        let retry = 0
+        while (server.writes.length < numFibers * numWrites && retry++ < 50)
+            await ds.sleep(10)
+        expect(server.writes.length).toBe(numFibers * numWrites)
+    })
+
+    test("send rate spaces packets without holding up other roles", async () => {
+        const slowServer = new RecordingRelayServer()
+        const fastServer = new RecordingRelayServer()
+        const slow = new ds.Relay(startServer(slowServer))
+        const fast = new ds.Relay(startServer(fastServer))
+        await slow.enabled.read()
+        await fast.enabled.read()
+
+        // burst of 1, then one packet every 50ms
+        slow.setSendRate(20, 1)
+        const numSlow = 4
+        const numFast = 10
+        async function writer(relay: ds.Relay, num: number) {
+            for (let i = 0; i < num; ++i) await relay.enabled.write((i & 1) === 1)
+        }
+        writer.start(slow, numSlow)
+        writer.start(fast, numFast)
+
+        let retry = 0
+        while (slowServer.writes.length < numSlow && retry++ < 100)
+            await ds.sleep(10)
+        expect(slowServer.writes.length).toBe(numSlow)
+        for (let i = 1; i < numSlow; ++i)
+            expect(slowServer.times[i] - slowServer.times[i - 1] >= 40).toBe(true)
+        // packets waiting for the slow role don't use up the budget of the other one
+        expect(fastServer.writes.length).toBe(numFast)
+        expect(fastServer.times[numFast - 1] < slowServer.times[numSlow - 1]).toBe(true)
+    })
+})
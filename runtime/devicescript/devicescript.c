@@ -29,9 +29,19 @@ static void setup_ctx(devs_ctx_t *ctx, const uint8_t *img) {
     devs_fiber_sync_now(ctx);
     devs_jd_reset_packet(ctx);
 
+#if DEVS_PROFILE_SIZE
+    if (devs_get_global_flags() & DEVS_FLAG_PROFILE)
+        devs_profile_start(ctx);
+#endif
+
     devs_jd_init_roles(ctx);
+    devs_jd_init_throttle(ctx);
     devs_gpio_init_dcfg(ctx);
 
+    int regcache_size = dcfg_get_i32("regCacheSize", 0);
+    if (regcache_size > 0)
+        ctx->regcache.capacity = regcache_size < 1024 ? regcache_size : 1024;
+
     if (ctx->error_code)
         return;
 
@@ -158,16 +168,29 @@ void devs_client_event_handler(devs_ctx_t *ctx, int event_id, void *arg0, void *
 }
 
 static void clear_ctx(devs_ctx_t *ctx) {
+    devs_vm_dump_stats(ctx);
+#if DEVS_PROFILE_SIZE
+    devs_profile_dump(ctx);
+    devs_profile_free(ctx);
+#endif
     devs_jd_free_roles(ctx);
     devs_vm_clear_breakpoints(ctx);
     devs_enter(ctx);
     devs_regcache_free_all(&ctx->regcache);
+#if DEVS_TX_BATCH_FRAMES
+    if (ctx->tx_batch)
+        jd_free(ctx->tx_batch);
+#endif
     devs_fiber_free_all_fibers(ctx);
     devs_free(ctx, ctx->globals);
     for (unsigned i = 0; i < ctx->num_roles; ++i)
         devs_free(ctx, ctx->roles[i]);
     devs_free(ctx, ctx->roles);
+    devs_free(ctx, ctx->role_dispatch);
     devs_gc_destroy(ctx->gc);
+#if DEVS_INSN_CACHE_SIZE
+    devs_vm_free_insns(ctx);
+#endif
     memset(ctx, 0, sizeof(*ctx));
 }
 
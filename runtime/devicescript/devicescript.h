@@ -31,8 +31,21 @@ void devs_free_ctx(devs_ctx_t *ctx);
 
 void devs_panic_handler(int exitcode);
 void devs_deploy_handler(int exitcode);
+// called when a program being profiled stops; see devs_profile_write_collapsed()
+void devs_profile_handler(devs_ctx_t *ctx);
+
+// writes one line per sampled stack, in flamegraph's collapsed format ("main_F0;foo_F3:12 17")
+typedef void (*devs_profile_line_cb_t)(void *userdata, const char *line);
+void devs_profile_write_collapsed(devs_ctx_t *ctx, devs_profile_line_cb_t cb, void *userdata);
 
 #define DEVS_FLAG_GC_STRESS (1U << 0)
+#define DEVS_FLAG_VM_STATS (1U << 1)
+#define DEVS_FLAG_PROFILE (1U << 2)
+
+// only do something when compiled with DEVS_VM_OPSTATS
+// with reset, counting starts over after the dump
+void devs_vm_opstats_dump(bool reset);
+void devs_vm_opstats_reset(void);
 
 void devs_set_global_flags(uint32_t global_flags);
 void devs_reset_global_flags(uint32_t global_flags);
@@ -21,24 +21,169 @@
 
 // this can't be more than a week; unit = ms
 #define DEVS_MAX_REG_VALIDITY (15 * 60 * 1000)
-#define DEVS_MAX_STEPS (128 * 1024)
+// a fiber gets preempted at the next safe point (backward jump or call) after this many steps
+#ifndef DEVS_SLICE_STEPS
+#define DEVS_SLICE_STEPS (8 * 1024)
+#endif
+// watchdog: steps a fiber can run without sleeping before we panic with InfiniteLoop
+#ifndef DEVS_MAX_STEPS
+#define DEVS_MAX_STEPS (16 * 1024 * 1024)
+#endif
 #define DEVS_NO_ROLE 0xffff
 
+// Packet send throttling (token buckets in jdiface.c): a role can send that many packets in a
+// burst, and then one every that many ms; the whole program is capped by the DEVS_THROTTLE_*
+// limits. Defaults; the "roleSendBurst", "roleSendCost", "sendBurst" and "sendCost" settings
+// override them, and DsRole.setSendRate() for a single role.
+#ifndef DEVS_THROTTLE_ROLE_BURST
+#define DEVS_THROTTLE_ROLE_BURST 5
+#endif
+#ifndef DEVS_THROTTLE_ROLE_COST_MS
+#define DEVS_THROTTLE_ROLE_COST_MS 20
+#endif
+#ifndef DEVS_THROTTLE_BURST
+#define DEVS_THROTTLE_BURST 20
+#endif
+#ifndef DEVS_THROTTLE_COST_MS
+#define DEVS_THROTTLE_COST_MS 5
+#endif
+
 #define DEVS_MAX_STACK_TRACE_FRAMES 16
 
+// bytes of jd_alloc() memory for pre-decoded function bodies (insn_cache.c); 0 disables
+#ifndef DEVS_INSN_CACHE_SIZE
+#if JD_HOSTED
+#define DEVS_INSN_CACHE_SIZE (64 * 1024)
+#else
+#define DEVS_INSN_CACHE_SIZE 0
+#endif
+#endif
+
 typedef struct devs_activation devs_activation_t;
 
+// bytes of per-fiber stack for activations (allocated from GC heap on first nested call, so fibers
+// that don't call other functions don't pay for it); 0 disables
+// activations that don't fit, or are captured by closures, live in GC heap
+// on 32-bit targets an activation is 24 bytes plus 8 per local, so 512 bytes holds a call chain
+// about 8 deep of functions with 4 locals
+#ifndef DEVS_FRAME_STACK_SIZE
+#if JD_HOSTED
+#define DEVS_FRAME_STACK_SIZE 4096
+#else
+#define DEVS_FRAME_STACK_SIZE 512
+#endif
+#endif
+
+// sampling profiler (profile.c); number of hash table entries, has to be power of 2; 0 disables
+#ifndef DEVS_PROFILE_SIZE
+#if JD_HOSTED
+#define DEVS_PROFILE_SIZE 512
+#else
+#define DEVS_PROFILE_SIZE 64
+#endif
+#endif
+
+// per-fiber accounting of steps, run time, allocation and wait time (DsFiber.stats, debugger)
+#ifndef DEVS_FIBER_STATS
+#define DEVS_FIBER_STATS 1
+#endif
+// sample every that many instructions; prime, so it doesn't line up with loop bodies
+#ifndef DEVS_PROFILE_INTERVAL
+#define DEVS_PROFILE_INTERVAL 997
+#endif
+#define DEVS_PROFILE_DEPTH 8
+
+// a due fiber that has waited that long runs before fibers of higher priority classes
+#ifndef DEVS_FIBER_AGING_MS
+#define DEVS_FIBER_AGING_MS 100
+#endif
+
+typedef struct {
+    uint32_t count; // 0 for empty entries
+    devs_pc_t pc;   // in the innermost function
+    uint8_t depth;
+    uint8_t truncated;               // stack was deeper than DEVS_PROFILE_DEPTH
+    uint16_t fn[DEVS_PROFILE_DEPTH]; // function indices, innermost first
+} devs_profile_entry_t;
+
+typedef struct {
+    uint32_t num_samples;
+    uint32_t num_dropped; // samples not recorded because the table was full
+    uint16_t num_entries;
+    uint16_t countdown; // steps until the next sample; carries over between time slices
+    uint8_t running;
+    devs_profile_entry_t entries[DEVS_PROFILE_SIZE];
+} devs_profile_t;
+
+// inline caches for static field reads, indexed by pc; has to be power of 2
+#ifndef DEVS_FIELD_IC_SIZE
+#if JD_HOSTED
+#define DEVS_FIELD_IC_SIZE 256
+#else
+#define DEVS_FIELD_IC_SIZE 32
+#endif
+#endif
+#define DEVS_FIELD_IC_WAYS 2
+
+// packets sent by fibers are collected into frames per device, sent at the end of
+// devs_fiber_poke(); number of frames being filled at a time, 0 sends every packet right away
+#ifndef DEVS_TX_BATCH_FRAMES
+#define DEVS_TX_BATCH_FRAMES 4
+#endif
+
+#if DEVS_TX_BATCH_FRAMES
+typedef struct {
+    uint8_t num_frames;
+    jd_frame_t frames[DEVS_TX_BATCH_FRAMES]; // oldest first
+} devs_tx_batch_t;
+#endif
+
+typedef struct {
+    devs_pc_t pc;
+    uint16_t slots[DEVS_FIELD_IC_WAYS]; // index of key in devs_map_t; most recent first
+} devs_field_ic_t;
+
+// pre-decoded instruction
+typedef struct {
+    uint8_t op;
+    uint8_t size; // 0 if not decoded - use bytecode
+    uint16_t reserved;
+    int32_t arg; // literal_int for DEVS_BYTECODEFLAG_TAKES_NUMBER
+} devs_vm_insn_t;
+
 #define DEVS_PKT_KIND_NONE 0
 #define DEVS_PKT_KIND_REG_GET 1
 #define DEVS_PKT_KIND_SEND_PKT 2
 #define DEVS_PKT_KIND_SEND_RAW_PKT 3
 #define DEVS_PKT_KIND_SUSPENDED 4
 #define DEVS_PKT_KIND_AWAITING 5
+#define DEVS_PKT_KIND_NUM 6
+
+// fiber priority classes; role event handlers and socket callbacks start as HIGH
+#define DEVS_FIBER_PRIO_LOW 0
+#define DEVS_FIBER_PRIO_DEFAULT 1
+#define DEVS_FIBER_PRIO_HIGH 2
+#define DEVS_FIBER_NUM_PRIO 3
+
+typedef struct {
+    uint32_t steps;
+    uint32_t run_us;
+    uint32_t alloc_bytes;
+    uint32_t num_gcs; // collections started by allocations of this fiber
+    // ms spent blocked, by pkt_kind; DEVS_PKT_KIND_NONE is sleep and preemption
+    uint32_t wait_ms[DEVS_PKT_KIND_NUM];
+} devs_fiber_stats_t;
 
 typedef void (*devs_resume_cb_t)(devs_ctx_t *ctx, void *userdata);
 
 typedef struct devs_fiber {
     struct devs_fiber *next;
+    struct devs_fiber *prev;
+    // hash chains in ctx->fiber_index
+    struct devs_fiber *fidx_next;
+    struct devs_fiber *fidx_prev;
+    struct devs_fiber *tag_next;
+    struct devs_fiber *tag_prev;
 
     union {
         struct {
@@ -57,9 +202,15 @@ typedef struct devs_fiber {
 
     uint8_t pending : 1;
     uint8_t role_wkp : 1;
-    uint8_t reserved_flag : 2;
+    uint8_t in_ready_list : 1;
+    uint8_t reg_get_follower : 1; // REG_GET waiting for another fiber's request
+    uint8_t throttled : 1;        // pending packet was already counted as throttled
 
     uint8_t stack_depth;
+    uint8_t prio; // DEVS_FIBER_PRIO_*
+
+    // number of time slices used up since the fiber last slept
+    uint16_t num_slices;
 
     uint16_t role_idx;
     uint16_t service_command;
@@ -67,9 +218,15 @@ typedef struct devs_fiber {
     uint16_t bottom_function_idx; // the id of function at the bottom of the stack
 
     uint32_t wake_time;
+    // 1-based index in the ctx->sleep_heap of prio; 0 if wake_time is 0
+    uint16_t sleep_idx;
 
     uint32_t handle_tag;
 
+    // links in ctx->ready_list
+    struct devs_fiber *ready_next;
+    struct devs_fiber *ready_prev;
+
     value_t ret_val;
 
     devs_activation_t *activation;
@@ -77,8 +234,26 @@ typedef struct devs_fiber {
 
     devs_resume_cb_t resume_cb;
     void *resume_data;
+
+#if DEVS_FRAME_STACK_SIZE
+    uint8_t *frames;     // pinned, DEVS_FRAME_STACK_SIZE bytes
+    uint16_t frames_top; // bytes in use
+#endif
+
+#if DEVS_FIBER_STATS
+    uint32_t wait_start; // devs_now() when the fiber last yielded
+    devs_fiber_stats_t stats;
+#endif
 } devs_fiber_t;
 
+static inline bool devs_fiber_owns_frame(devs_fiber_t *fib, devs_activation_t *act) {
+#if DEVS_FRAME_STACK_SIZE
+    return (uintptr_t)act - (uintptr_t)fib->frames < DEVS_FRAME_STACK_SIZE;
+#else
+    return false;
+#endif
+}
+
 static inline bool devs_fiber_uses_pkt_data_v(devs_fiber_t *fib) {
     // return fib->pkt_kind == DEVS_PKT_KIND_SEND_RAW_PKT;
     return false;
@@ -90,6 +265,7 @@ static inline bool devs_fiber_uses_pkt_data_v(devs_fiber_t *fib) {
 #define DEVS_CTX_TRACE_DISABLED 0x08
 #define DEVS_CTX_PENDING_RESUME 0x10
 #define DEVS_CTX_PENDING_ROLES 0x20
+#define DEVS_CTX_PREEMPTED 0x40
 
 #define DEVS_CTX_STEP_EN 0x01
 #define DEVS_CTX_STEP_BRK 0x02
@@ -97,10 +273,27 @@ static inline bool devs_fiber_uses_pkt_data_v(devs_fiber_t *fib) {
 #define DEVS_CTX_STEP_OUT 0x08
 #define DEVS_CTX_STEP_HALT 0x80
 
+typedef struct {
+    uint32_t sent;         // packets queued for sending
+    uint32_t throttled;    // packets delayed
+    uint32_t throttled_ms; // total delay
+} devs_role_send_stats_t;
+
 typedef struct {
     value_t name;
     jd_role_t *jdrole;
     devs_map_t *attached;
+    // key under which the role is in ctx->role_dispatch, if dispatch_bound
+    uint64_t dispatch_device;
+    uint8_t dispatch_service_index;
+    uint8_t dispatch_bound;
+    uint16_t dispatch_next; // role index + 1 of the next role in the bucket; 0 at the end
+    // send token bucket; see throttle_send_pkt()
+    uint32_t send_throttle;
+    uint16_t send_cost_ms; // 0 if only the global limit applies
+    uint8_t send_burst;
+    devs_role_send_stats_t send_stats;
+    uint32_t reported_throttled; // send_stats.throttled at the last warning
 } devs_role_t;
 
 #define DEVS_BRK_FLAG_STEP 0x01
@@ -138,6 +331,7 @@ struct devs_ctx {
     uint8_t stack_top_for_gc;
     uint8_t _num_builtin_protos;
     uint8_t in_throw;
+    uint8_t preempt_pending;
     uint8_t suspension;
     uint8_t dbg_en;
     uint8_t ignore_brk;
@@ -152,13 +346,36 @@ struct devs_ctx {
     devs_short_map_t *fn_values;
     devs_short_map_t *spec_protos;
 
+    devs_map_shape_t *root_shape;
+    uint16_t num_shapes;
+
     devs_img_t img;
 
     devs_activation_t *curr_fn;
     devs_fiber_t *curr_fiber;
 
     devs_fiber_t *fibers;
+    devs_fiber_t *fibers_tail;
+    uint16_t num_fibers;
+    // fiber_index_size heads of buckets by bottom_function_idx, then their tails,
+    // then as many heads of buckets by handle_tag
+    uint16_t fiber_index_size;
+    devs_fiber_t **fiber_index;
+    // min-heaps of fibers with wake_time set, sleep_heap_size entries per priority class;
+    // see fibers.c
+    uint16_t sleep_heap_len[DEVS_FIBER_NUM_PRIO];
+    uint16_t sleep_heap_size;
+    devs_fiber_t **sleep_heap;
+    // fibers with role_wkp set or awaiting devs_fiber_await_done()
+    devs_fiber_t *ready_list;
+    devs_fiber_t *ready_tail;
     devs_role_t **roles;
+    // role_dispatch_size buckets of bound roles by (device_identifier, service_index), holding
+    // role index + 1; rebuilt with num_roles buckets whenever ctx->roles grows, and a role is
+    // only allocated once that succeeded; NULL after a failed rebuild, until the next role
+    // allocation retries it; packets are matched against all roles meanwhile
+    uint16_t *role_dispatch;
+    uint16_t role_dispatch_size;
 
     // use devs_get_builtin_object()
     devs_map_t **_builtin_protos;
@@ -168,10 +385,18 @@ struct devs_ctx {
     uint64_t _now_long;
     uint32_t _logged_now;
 
+    // only updated with DEVS_FLAG_VM_STATS
+    uint64_t vm_stat_ops;
+    uint64_t vm_stat_us;
+
     uint32_t fiber_handle_tag;
     uint32_t send_pkt_throttle;
+    uint16_t send_cost_ms;
+    uint8_t send_burst;
+    uint8_t role_send_burst;
+    uint16_t role_send_cost_ms;
 
-    uint32_t num_throttled_pkts;
+    uint32_t num_throttled_pkts; // by the global limit
     uint32_t last_warning;
 
     uint32_t ctx_seq_no;
@@ -186,6 +411,8 @@ struct devs_ctx {
     devs_brk_t *brk_list;
     uint16_t brk_count;
     uint8_t brk_jump_tbl[DEVS_BRK_HASH_SIZE];
+    // bit per function with any breakpoints; NULL when there are none
+    uint32_t *brk_fn_map;
 
     uint8_t program_hash[JD_SHA256_HASH_BYTES];
 
@@ -195,6 +422,23 @@ struct devs_ctx {
     };
 
     devs_regcache_t regcache;
+
+#if DEVS_TX_BATCH_FRAMES
+    devs_tx_batch_t *tx_batch; // jd_alloc()ed on first use
+#endif
+
+#if DEVS_FIELD_IC_SIZE
+    devs_field_ic_t field_ic[DEVS_FIELD_IC_SIZE];
+#endif
+
+#if DEVS_INSN_CACHE_SIZE
+    devs_vm_insn_t **insn_cache; // indexed by function
+    uint32_t insn_cache_size;
+#endif
+
+#if DEVS_PROFILE_SIZE
+    devs_profile_t *profile; // NULL unless profiling
+#endif
 };
 
 struct devs_activation {
@@ -204,6 +448,9 @@ struct devs_activation {
     devs_activation_t *closure;
     devs_activation_t *caller;
     const devs_function_desc_t *func;
+#if DEVS_INSN_CACHE_SIZE
+    const devs_vm_insn_t *insns; // indexed by pc - func->start; can be NULL
+#endif
     value_t slots[0];
 };
 
@@ -259,20 +506,33 @@ int devs_jd_alloc_role(devs_ctx_t *ctx, value_t name, uint32_t srv_class);
 void devs_jd_role_changed(devs_ctx_t *ctx, jd_role_t *role);
 void devs_jd_clear_pkt_kind(devs_fiber_t *fib);
 void devs_jd_send_logmsg(devs_ctx_t *ctx, char lev, value_t str);
+void devs_jd_init_throttle(devs_ctx_t *ctx);
+void devs_jd_print_throttled(devs_ctx_t *ctx);
+// returns true if some frames couldn't be sent, and should be retried soon
+bool devs_jd_flush_tx(devs_ctx_t *ctx);
 uint64_t devs_jd_server_device_id(void);
 void devs_jd_after_user(devs_ctx_t *ctx);
 
 // fibers.c
 void devs_fiber_set_wake_time(devs_fiber_t *fiber, unsigned time);
 void devs_fiber_sleep(devs_fiber_t *fiber, unsigned time);
+void devs_fiber_set_priority(devs_fiber_t *fiber, unsigned prio);
 void devs_fiber_termiante(devs_fiber_t *fiber);
 void devs_fiber_yield(devs_ctx_t *ctx);
+void devs_fiber_preempt(devs_ctx_t *ctx);
 void devs_fiber_await(devs_fiber_t *fib, uint8_t *awaiting);
 void devs_fiber_await_done(uint8_t *awaiting);
+// make devs_fiber_poke() check the fiber before the timers; for role_wkp
+void devs_fiber_add_ready(devs_fiber_t *fiber);
 // if `args` is passed, `numparams==0`
 // otherwise, `numparams` arguments are sought on the_stack
 int devs_fiber_call_function(devs_fiber_t *fiber, unsigned numparams, devs_array_t *args);
 void devs_fiber_return_from_call(devs_fiber_t *fiber, devs_activation_t *act);
+// like devs_fiber_call_function(), but the current activation is dropped first;
+// it has to have a caller and the function in the_stack[0] can't be a builtin
+int devs_fiber_tail_call(devs_fiber_t *fiber, unsigned numparams);
+// moves an activation off fiber's frame stack (if it's there), returns the new address
+devs_activation_t *devs_fiber_promote_frame(devs_ctx_t *ctx, devs_activation_t *act);
 devs_fiber_t *devs_fiber_start(devs_ctx_t *ctx, unsigned numargs, unsigned op);
 devs_fiber_t *devs_fiber_by_tag(devs_ctx_t *ctx, unsigned tag);
 devs_fiber_t *devs_fiber_by_fidx(devs_ctx_t *ctx, unsigned fidx);
@@ -282,8 +542,27 @@ void devs_fiber_sync_now(devs_ctx_t *ctx);
 void devs_fiber_free_all_fibers(devs_ctx_t *ctx);
 unsigned devs_fiber_get_max_sleep(devs_ctx_t *ctx);
 
+// insn_cache.c
+#if DEVS_INSN_CACHE_SIZE
+const devs_vm_insn_t *devs_vm_get_insns(devs_ctx_t *ctx, const devs_function_desc_t *func);
+void devs_vm_free_insns(devs_ctx_t *ctx);
+#endif
+
+// profile.c
+#if DEVS_PROFILE_SIZE
+void devs_profile_start(devs_ctx_t *ctx);
+// stops sampling; collected samples are kept until the next start
+void devs_profile_stop(devs_ctx_t *ctx);
+void devs_profile_free(devs_ctx_t *ctx);
+void devs_profile_sample(devs_ctx_t *ctx);
+// logs per-function summary and calls devs_profile_handler()
+void devs_profile_dump(devs_ctx_t *ctx);
+#endif
+
 // vm_main.c
-void devs_vm_exec_opcodes(devs_ctx_t *ctx);
+// returns number of steps executed
+unsigned devs_vm_exec_opcodes(devs_ctx_t *ctx);
+void devs_vm_dump_stats(devs_ctx_t *ctx);
 bool devs_in_vm_loop(devs_ctx_t *ctx);
 uint8_t devs_fetch_opcode(devs_activation_t *frame, devs_ctx_t *ctx);
 
@@ -33,15 +33,41 @@ struct devs_maplike {
 };
 typedef const struct devs_maplike devs_maplike_t;
 
+// Shared key layout of maps; see shape.c.
+// Transition keys are always static strings, so keys[] doesn't need scanning.
+typedef struct devs_map_shape {
+    devs_gc_object_t gc;
+    struct devs_map_shape *parent;
+    struct devs_map_shape *first_child;
+    struct devs_map_shape *next_sibling;
+    value_t *keys;   // shared with parent when this is its first child
+    uint16_t *index; // open addressing, slot+1; only for larger shapes
+    devs_small_size_t length;
+    devs_small_size_t keys_capacity;
+    uint8_t num_children;
+    uint8_t index_bits;
+} devs_map_shape_t;
+
 typedef struct {
     devs_gc_object_t gc;
     devs_maplike_t *proto;
     devs_small_size_t length;
     devs_small_size_t capacity;
+    // when shape is NULL (dictionary mode) data[] holds interleaved key/value pairs;
+    // otherwise it only holds values and keys are in shape->keys[]
     value_t *data;
+    devs_map_shape_t *shape;
 } devs_map_t;
 
-// same structure as devs_map_t but data[] field is different
+static inline value_t devs_map_key_at(devs_map_t *map, unsigned idx) {
+    return map->shape ? map->shape->keys[idx] : map->data[idx * 2];
+}
+
+static inline value_t *devs_map_value_ptr(devs_map_t *map, unsigned idx) {
+    return map->shape ? &map->data[idx] : &map->data[idx * 2 + 1];
+}
+
+// same structure as devs_map_t (up to data[]) but data[] field is different, and there is no shape
 typedef struct {
     devs_gc_object_t gc;
     devs_maplike_t *proto;
@@ -108,9 +134,23 @@ typedef struct {
     uint8_t service_index;
     uint16_t crc;
     devs_map_t *attached;
+    // created from inline_payload when the payload property is first read, so that handlers
+    // which only decode() don't allocate a buffer per packet; the buffer is the payload after that
     devs_buffer_t *payload;
+    uint8_t inline_size;
+    uint8_t inline_payload[0];
 } devs_packet_t;
 
+// payload bytes, without creating the payload buffer
+static inline uint8_t *devs_packet_data(devs_packet_t *pkt, unsigned *size) {
+    if (pkt->payload) {
+        *size = pkt->payload->length;
+        return pkt->payload->data;
+    }
+    *size = pkt->inline_size;
+    return pkt->inline_payload;
+}
+
 typedef struct {
     devs_gc_object_t gc;
     devs_small_size_t width;
@@ -130,6 +170,12 @@ void devs_map_clear(devs_ctx_t *ctx, devs_map_t *map);
 void devs_map_copy_into(devs_ctx_t *ctx, devs_map_t *dst, devs_maplike_t *src);
 void devs_map_set_string_field(devs_ctx_t *ctx, devs_map_t *m, unsigned builtin_str, value_t msg);
 
+// shape.c
+devs_map_shape_t *devs_shape_root(devs_ctx_t *ctx);
+devs_map_shape_t *devs_shape_transition(devs_ctx_t *ctx, devs_map_shape_t *sh, value_t key);
+// only compares key handles; -1 if not found
+int devs_shape_find(devs_map_shape_t *sh, value_t key);
+
 typedef void (*devs_map_iter_cb_t)(devs_ctx_t *ctx, void *userdata, value_t k, value_t v);
 unsigned devs_maplike_iter(devs_ctx_t *ctx, devs_maplike_t *src, void *userdata,
                            devs_map_iter_cb_t cb);
@@ -150,6 +196,8 @@ int devs_array_insert(devs_ctx_t *ctx, devs_array_t *arr, unsigned idx, int coun
 void devs_array_pin_push(devs_ctx_t *ctx, devs_array_t *arr, value_t v);
 
 value_t devs_object_get(devs_ctx_t *ctx, value_t obj, value_t key);
+// same as devs_object_get(), but uses inline cache for the instruction at pc
+value_t devs_object_get_cached(devs_ctx_t *ctx, value_t obj, value_t key, unsigned pc);
 value_t devs_object_get_built_in_field(devs_ctx_t *ctx, value_t obj, unsigned idx);
 bool devs_instance_of(devs_ctx_t *ctx, value_t obj, devs_maplike_t *cls_proto);
 devs_maplike_t *devs_get_prototype_field(devs_ctx_t *ctx, value_t cls);
@@ -187,6 +235,8 @@ value_t devs_value_from_service_spec(devs_ctx_t *ctx, const devs_service_spec_t
 void devs_packet_encode(devs_ctx_t *ctx, const devs_packet_spec_t *pkt);
 
 devs_packet_t *devs_value_to_packet_or_throw(devs_ctx_t *ctx, value_t self);
+// creates the payload buffer if needed; NULL on OOM
+devs_buffer_t *devs_packet_payload(devs_ctx_t *ctx, devs_packet_t *pkt);
 
 // GC
 
@@ -233,6 +283,8 @@ void *devs_any_try_alloc(devs_ctx_t *ctx, unsigned tag, unsigned size);
 devs_gc_t *devs_gc_create(void);
 void devs_gc_set_ctx(devs_gc_t *gc, devs_ctx_t *ctx);
 void devs_gc_destroy(devs_gc_t *gc);
+// allocation latency percentiles; only collected with DEVS_FLAG_VM_STATS
+void devs_gc_dump_stats(devs_gc_t *gc);
 
 #define DEVS_GC_MK_TAG_WORDS(tag, size) ((size) | ((uintptr_t)(tag) << DEVS_GC_TAG_POS))
 #define DEVS_GC_MK_TAG_BYTES(tag, size)                                                            \
@@ -263,6 +315,7 @@ void devs_gc_destroy(devs_gc_t *gc);
 #define DEVS_GC_TAG_PACKET 0xB
 #define DEVS_GC_TAG_STRING_JMP 0xC
 #define DEVS_GC_TAG_IMAGE 0xD
+#define DEVS_GC_TAG_SHAPE 0xE
 #define DEVS_GC_TAG_BUILTIN_PROTO DEVS_GC_TAG_MASK // these are not in GC heap!
 #define DEVS_GC_TAG_FINAL (DEVS_GC_TAG_MASK | DEVS_GC_TAG_MASK_PINNED)
 
@@ -287,6 +340,10 @@ const char *devs_gc_tag_name(unsigned tag);
 
 void jd_gc_unpin(devs_gc_t *gc, void *ptr);
 void jd_gc_free(devs_gc_t *gc, void *ptr);
+// like devs_try_alloc() (pinned) but returns NULL instead of panicking with OOM
+void *jd_gc_try_alloc_pinned(devs_gc_t *gc, uint32_t size);
+// like devs_any_try_alloc() but returns NULL instead of panicking with OOM
+void *jd_gc_any_try_alloc(devs_gc_t *gc, unsigned tag, uint32_t size);
 #if JD_64
 void *devs_gc_base_addr(devs_gc_t *gc);
 #else
@@ -1,7 +1,7 @@
 #define DEVS_QUERY_MAX_INLINE 9
 typedef struct devs_regcache_entry {
     uint16_t role_idx;
-    uint16_t service_command;
+    uint16_t service_command; // 0 for free entries
     uint32_t last_refresh_time;
     union {
         uint32_t u32;
@@ -10,13 +10,36 @@ typedef struct devs_regcache_entry {
     } value;
     uint8_t resp_size;
     uint16_t argument;
+    // links are entry index + 1, 0 meaning none
+    uint16_t hash_next;
+    uint16_t lru_prev; // more recently used; unused for free entries
+    uint16_t lru_next; // less recently used; next free entry for free entries
 } devs_regcache_entry_t;
 
+// default capacity; can be overridden with the "regCacheSize" setting
+#ifndef DEVS_REGCACHE_NUM_ENTRIES
 #define DEVS_REGCACHE_NUM_ENTRIES 20
+#endif
+
+// also the payload of DEVS_TRACE_EV_REGCACHE_STATS
+typedef struct {
+    uint16_t capacity;
+    uint16_t num_used;
+    uint32_t hits;   // register reads served from the cache
+    uint32_t misses; // register reads that went to the bus
+    uint32_t evictions;
+} devs_regcache_stats_t;
 
 typedef struct devs_regcache {
-    devs_regcache_entry_t entries[DEVS_REGCACHE_NUM_ENTRIES];
-    uint16_t latest_idx;
+    devs_regcache_entry_t *entries; // capacity entries, allocated on first use
+    uint16_t *buckets;              // num_buckets hash chains by (role_idx, service_command)
+    uint16_t capacity;              // DEVS_REGCACHE_NUM_ENTRIES when 0
+    uint16_t num_buckets;           // power of 2
+    uint16_t lru_head;              // most recently used
+    uint16_t lru_tail;              // least recently used; evicted first
+    uint16_t free_head;
+    devs_regcache_stats_t stats;
+    uint32_t traced_lookups; // hits + misses at the last DEVS_TRACE_EV_REGCACHE_STATS
 } devs_regcache_t;
 
 static inline void *devs_regcache_data(devs_regcache_entry_t *q) {
@@ -25,4 +25,16 @@ typedef struct {
     devs_pc_t pc;
 } devs_trace_ev_fiber_yield_t;
 
+// after every run of a fiber, with DEVS_FIBER_STATS; totals since the fiber started
+#define DEVS_TRACE_EV_FIBER_STATS 0x48
+typedef struct {
+    uint32_t handle_tag;
+    uint32_t steps;
+    uint32_t run_us;
+    uint32_t alloc_bytes;
+} devs_trace_ev_fiber_stats_t;
+
+// every few seconds, if registers were read since the last one; payload is devs_regcache_stats_t
+#define DEVS_TRACE_EV_REGCACHE_STATS 0x49
+
 void devs_trace(devs_ctx_t *ctx, unsigned trace_type, const void *data, unsigned data_size);
@@ -152,6 +152,13 @@ bool devs_is_number(value_t t);
 
 value_t devs_value_from_double(double v);
 value_t devs_value_from_int(int v);
+// inline version of devs_value_from_int(), for the interpreter fast paths
+static inline value_t devs_value_from_i32(int32_t v) {
+    value_t r;
+    r.exp_sign = DEVS_INT_TAG;
+    r.val_int32 = v;
+    return r;
+}
 value_t devs_value_from_bool(int v);
 value_t devs_value_from_pointer(devs_ctx_t *ctx, int handle_type, void *ptr);
 static inline value_t devs_value_from_gc_obj(devs_ctx_t *ctx, void *ptr) {
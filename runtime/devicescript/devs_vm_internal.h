@@ -14,3 +14,192 @@ extern const void *const devs_vm_op_handlers[];
 
 typedef void (*devs_vm_stmt_handler_t)(devs_activation_t *frame, devs_ctx_t *ctx);
 typedef value_t (*devs_vm_expr_handler_t)(devs_activation_t *frame, devs_ctx_t *ctx);
+
+// Per-opcode execution counts, time and opcode pair counts (vm_opstats.c), for tuning vm_ops.c.
+// Only the switch/table loop is instrumented.
+#ifndef DEVS_VM_OPSTATS
+#define DEVS_VM_OPSTATS 0
+#endif
+
+// Direct-threaded dispatch (labels-as-values) is a GCC extension; the switch/table loop in
+// vm_main.c is used everywhere else.
+#ifndef DEVS_VM_THREADED
+#if defined(__GNUC__) && !defined(__EMSCRIPTEN__) && !DEVS_VM_OPSTATS
+#define DEVS_VM_THREADED 1
+#else
+#define DEVS_VM_THREADED 0
+#endif
+#endif
+
+// int32 fast paths in arithmetic and comparison operators; 0 forces the generic path (for benchmarks)
+#ifndef DEVS_VM_INT_FASTPATH
+#define DEVS_VM_INT_FASTPATH 1
+#endif
+
+// `return f(...)` reuses the caller's frame (see tail_call_ok() in vm_ops.c)
+#ifndef DEVS_VM_TAIL_CALLS
+#define DEVS_VM_TAIL_CALLS 1
+#endif
+
+// direct calls to builtin methods from stmt*_call*; 0 sends them through devs_fiber_call_function()
+#ifndef DEVS_VM_BUILTIN_FASTPATH
+#define DEVS_VM_BUILTIN_FASTPATH 1
+#endif
+
+// Run functions translated to C ahead of time (see posix/aot.c) where available.
+// Only hooked into the switch/table loop.
+#ifndef DEVS_VM_AOT
+#define DEVS_VM_AOT 0
+#endif
+
+#if DEVS_VM_AOT
+#if DEVS_VM_THREADED || DEVS_VM_OPSTATS
+#error "DEVS_VM_AOT requires DEVS_VM_THREADED=0 and DEVS_VM_OPSTATS=0"
+#endif
+#endif
+
+// Runs frame from frame->pc, while it stays the current function; returns remaining maxsteps,
+// same as the loop in devs_vm_exec_opcodes().
+typedef unsigned (*devs_aot_fn_t)(devs_ctx_t *ctx, devs_activation_t *frame, unsigned maxsteps);
+typedef struct {
+    uint32_t hash; // devs_aot_image_hash()
+    uint32_t num_functions;
+    const devs_aot_fn_t *functions; // NULL entries are interpreted
+} devs_aot_image_t;
+
+uint32_t devs_aot_image_hash(const uint8_t *img);
+const devs_aot_image_t *devs_aot_get_image(void);
+#if DEVS_VM_AOT
+devs_aot_fn_t devs_vm_aot_lookup(devs_ctx_t *ctx, const devs_function_desc_t *func);
+#endif
+
+// Compile hot functions to machine code at runtime (vm_jit.c); x86-64 Linux hosts only.
+// A function is hot once it was entered DEVS_VM_JIT_CALLS times or has run
+// DEVS_VM_JIT_STEPS instructions in the interpreter.
+#ifndef DEVS_VM_JIT
+#define DEVS_VM_JIT 0
+#endif
+
+#if DEVS_VM_JIT
+#if !defined(__x86_64__) || !defined(__linux__)
+#error "DEVS_VM_JIT is only supported on x86-64 Linux"
+#endif
+#if DEVS_VM_THREADED || DEVS_VM_OPSTATS
+#error "DEVS_VM_JIT requires DEVS_VM_THREADED=0 and DEVS_VM_OPSTATS=0"
+#endif
+#ifndef DEVS_VM_JIT_CALLS
+#define DEVS_VM_JIT_CALLS 50
+#endif
+#ifndef DEVS_VM_JIT_STEPS
+#define DEVS_VM_JIT_STEPS 5000
+#endif
+// returns NULL until func is hot, or when it can't be compiled
+devs_aot_fn_t devs_vm_jit_lookup(devs_ctx_t *ctx, const devs_function_desc_t *func);
+void devs_vm_jit_add_steps(devs_ctx_t *ctx, const devs_function_desc_t *func, unsigned steps);
+#endif
+
+#if DEVS_VM_OPSTATS
+#if DEVS_VM_THREADED
+#error "DEVS_VM_OPSTATS requires DEVS_VM_THREADED=0"
+#endif
+void devs_vm_opstats_start(unsigned op);
+void devs_vm_opstats_end(void);
+// called when switching fibers, so that unrelated opcodes are not counted as pairs
+void devs_vm_opstats_break(void);
+#endif
+
+#if DEVS_VM_THREADED
+// returns remaining maxsteps, same as the loop in devs_vm_exec_opcodes()
+unsigned devs_vm_exec_threaded(devs_ctx_t *ctx, unsigned maxsteps);
+#endif
+
+static inline uint8_t devs_vm_fetch_byte(devs_activation_t *frame, devs_ctx_t *ctx) {
+    if (frame->pc < frame->maxpc)
+        return ctx->img.data[frame->pc++];
+    devs_invalid_program(ctx, 60100);
+    return 0;
+}
+
+// pre-decoded form of the instruction at frame->pc, if any; not used when debugging
+static inline const devs_vm_insn_t *devs_vm_decoded_insn(devs_ctx_t *ctx,
+                                                         devs_activation_t *frame) {
+#if DEVS_INSN_CACHE_SIZE
+    if (frame->insns && !ctx->dbg_en) {
+        const devs_vm_insn_t *insn = &frame->insns[frame->pc - frame->func->start];
+        if (insn->size)
+            return insn;
+    }
+#endif
+    return NULL;
+}
+
+static inline int32_t devs_vm_fetch_int(devs_activation_t *frame, devs_ctx_t *ctx) {
+    uint8_t v = devs_vm_fetch_byte(frame, ctx);
+    if (v < DEVS_FIRST_MULTIBYTE_INT)
+        return v;
+
+    int32_t r = 0;
+    bool n = !!(v & 4);
+    int len = (v & 3) + 1;
+    for (int i = 0; i < len; ++i) {
+        uint8_t b = devs_vm_fetch_byte(frame, ctx);
+        r <<= 8;
+        r |= b;
+    }
+
+    return n ? -r : r;
+}
+
+static inline void devs_vm_push(devs_ctx_t *ctx, value_t v) {
+    if (ctx->stack_top >= DEVS_MAX_STACK_DEPTH)
+        devs_invalid_program(ctx, 60101);
+    else
+        ctx->the_stack[ctx->stack_top++] = v;
+}
+
+static inline unsigned brk_hash(unsigned pc) {
+    return pc & (DEVS_BRK_HASH_SIZE - 1);
+}
+
+// whether devs_vm_chk_brk() can ever stop in func
+static inline bool devs_vm_func_has_brk(devs_ctx_t *ctx, const devs_function_desc_t *func) {
+    const uint32_t *map = ctx->brk_fn_map;
+    if (!map)
+        return false;
+    unsigned idx = func - devs_img_get_function(ctx->img, 0);
+    return (map[idx >> 5] >> (idx & 31)) & 1;
+}
+
+static inline bool devs_vm_chk_brk(devs_ctx_t *ctx, devs_activation_t *frame) {
+    if (ctx->dbg_en) {
+        if (ctx->ignore_brk) {
+            ctx->ignore_brk = false;
+            return false;
+        }
+
+        devs_pc_t pc = frame->pc;
+        unsigned i = ctx->brk_jump_tbl[brk_hash(pc)];
+
+        if (i) {
+            devs_brk_t *l = ctx->brk_list;
+            for (--i; pc >= l[i].pc; ++i) {
+                if (pc == l[i].pc) {
+                    if (l[i].flags & DEVS_BRK_FLAG_STEP) {
+                        // DMESG("chk step %d %p %p", pc, frame, ctx->step_fn);
+                        if (frame == ctx->step_fn) {
+                            devs_vm_suspend(ctx, JD_DEVS_DBG_SUSPENSION_TYPE_STEP);
+                            return true;
+                        } else {
+                            continue;
+                        }
+                    } else {
+                        devs_vm_suspend(ctx, JD_DEVS_DBG_SUSPENSION_TYPE_BREAKPOINT);
+                        return true;
+                    }
+                }
+            }
+        }
+    }
+
+    return false;
+}
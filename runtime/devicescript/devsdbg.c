@@ -7,6 +7,36 @@
 #define LOG_TAG "dbg"
 #include "devs_logging.h"
 
+// sampling profiler; not in the service spec (yet)
+// payload: u8 enabled; enabling clears previously collected samples, disabling keeps them
+// for READ_PROFILE
+#define DEVS_DBG_CMD_PROFILE 0x8a
+// pipe with one devs_profile_entry_t per sampled stack (function indices as in READ_STACK)
+#define DEVS_DBG_CMD_READ_PROFILE 0x8b
+// pipe with one devs_dbg_fiber_stats_t per fiber
+#define DEVS_DBG_CMD_READ_FIBER_STATS 0x8c
+// pipe with a single devs_regcache_stats_t
+#define DEVS_DBG_CMD_READ_REGCACHE_STATS 0x8d
+// pipe with one devs_dbg_role_stats_t per role
+#define DEVS_DBG_CMD_READ_ROLE_STATS 0x8e
+
+typedef struct {
+    uint32_t handle;
+    uint16_t initial_fn;
+    uint16_t reserved;
+#if DEVS_FIBER_STATS
+    devs_fiber_stats_t stats;
+#endif
+} devs_dbg_fiber_stats_t;
+
+typedef struct {
+    uint16_t role_idx;
+    uint16_t send_cost_ms;
+    uint8_t send_burst;
+    uint8_t reserved[3];
+    devs_role_send_stats_t stats;
+} devs_dbg_role_stats_t;
+
 struct srv_state {
     SRV_COMMON;
     uint8_t enabled;
@@ -260,7 +290,9 @@ static void expand_value(devs_ctx_t *ctx, jd_devs_dbg_value_t *trg, value_t v) {
         JD_ASSERT(devs_gc_tag(b) == DEVS_GC_TAG_PACKET);
         trg->tag = JD_DEVS_DBG_VALUE_TAG_OBJ_PACKET;
         trg->v0 = hv;
-        trg->v1 = b->payload->length;
+        unsigned sz;
+        devs_packet_data(b, &sz);
+        trg->v1 = sz;
         trg->v1 |= HAS_NAMED; // device_id, etc always present
         break;
     }
@@ -544,9 +576,8 @@ static void read_bytes(cmd_t *cmd) {
     void *p = devs_value_to_gc_obj(ctx, v);
 
     if (devs_gc_tag(p) == DEVS_GC_TAG_PACKET)
-        v = devs_value_from_gc_obj(ctx, ((devs_packet_t *)p)->payload);
-
-    if (devs_is_buffer(ctx, v) || devs_is_string(ctx, v))
+        data = devs_packet_data(p, &sz);
+    else if (devs_is_buffer(ctx, v) || devs_is_string(ctx, v))
         data = devs_bufferish_data(ctx, v, &sz);
 
     if (args->start >= sz)
@@ -562,6 +593,102 @@ static void read_bytes(cmd_t *cmd) {
     }
 }
 
+static void profile_cmd(cmd_t *cmd) {
+#if DEVS_PROFILE_SIZE
+    devs_ctx_t *ctx = cmd->ctx;
+    if (!ctx || cmd->pkt->service_size < 1)
+        return;
+    if (cmd->pkt->data[0]) {
+        LOG("profile start");
+        devs_profile_start(ctx);
+    } else {
+        devs_profile_stop(ctx);
+    }
+#endif
+}
+
+static void read_profile(cmd_t *cmd) {
+#if DEVS_PROFILE_SIZE
+    devs_profile_t *prof = cmd->ctx ? cmd->ctx->profile : NULL;
+    if (prof && prof->num_entries) {
+        devs_profile_entry_t *r = devsdbg_open_results_pipe(cmd, sizeof(devs_profile_entry_t),
+                                                            prof->num_entries);
+        if (r) {
+            unsigned n = 0;
+            for (unsigned i = 0; i < DEVS_PROFILE_SIZE; ++i) {
+                if (prof->entries[i].count == 0)
+                    continue;
+                r[n] = prof->entries[i];
+                for (unsigned j = 0; j < r[n].depth; ++j)
+                    r[n].fn[j] = map_fn_idx(r[n].fn[j]);
+                n++;
+            }
+        }
+        return;
+    }
+#endif
+    send_empty(cmd);
+}
+
+static void read_fiber_stats(cmd_t *cmd) {
+    devs_ctx_t *ctx = cmd->ctx;
+    if (!ctx || !ctx->num_fibers) {
+        send_empty(cmd);
+        return;
+    }
+    devs_dbg_fiber_stats_t *r =
+        devsdbg_open_results_pipe(cmd, sizeof(devs_dbg_fiber_stats_t), ctx->num_fibers);
+    if (r) {
+        unsigned n = 0;
+        for (devs_fiber_t *f = ctx->fibers; f; f = f->next) {
+            r[n].handle = f->handle_tag;
+            r[n].initial_fn = map_fn_idx(f->bottom_function_idx);
+#if DEVS_FIBER_STATS
+            r[n].stats = f->stats;
+#endif
+            n++;
+        }
+    }
+}
+
+static void read_regcache_stats(cmd_t *cmd) {
+    devs_ctx_t *ctx = cmd->ctx;
+    if (!ctx) {
+        send_empty(cmd);
+        return;
+    }
+    devs_regcache_stats_t *r = devsdbg_open_results_pipe(cmd, sizeof(devs_regcache_stats_t), 1);
+    if (r)
+        *r = ctx->regcache.stats;
+}
+
+static void read_role_stats(cmd_t *cmd) {
+    devs_ctx_t *ctx = cmd->ctx;
+    unsigned num = 0;
+    if (ctx)
+        for (unsigned i = 0; i < ctx->num_roles; ++i)
+            if (devs_role(ctx, i))
+                num++;
+    if (!num) {
+        send_empty(cmd);
+        return;
+    }
+    devs_dbg_role_stats_t *r = devsdbg_open_results_pipe(cmd, sizeof(devs_dbg_role_stats_t), num);
+    if (r) {
+        unsigned n = 0;
+        for (unsigned i = 0; i < ctx->num_roles; ++i) {
+            devs_role_t *role = devs_role(ctx, i);
+            if (role) {
+                r[n].role_idx = i;
+                r[n].send_cost_ms = role->send_cost_ms;
+                r[n].send_burst = role->send_burst;
+                r[n].stats = role->send_stats;
+                n++;
+            }
+        }
+    }
+}
+
 static void resume_cmd(cmd_t *cmd) {
     cmd->state->suspended = 0;
     if (cmd->ctx) {
@@ -583,6 +710,12 @@ static void step_cmd(cmd_t *cmd) {
             return;
         }
 
+        // step_fn is compared against frames as they return; a frame stack slot can be reused
+        // by a later call, but a heap frame can't until GC clears step_fn
+        frame = devs_fiber_promote_frame(ctx, frame);
+        if (frame == NULL)
+            return;
+
         unsigned numbrk = (cmd->pkt->service_size - 8) / sizeof(uint32_t);
 
         ctx->step_flags = DEVS_CTX_STEP_EN;
@@ -653,8 +786,14 @@ void devsdbg_handle_packet(srv_t *state, jd_packet_t *pkt) {
         devs_fiber_t *fib =
             devs_fiber_by_tag(ctx, ((jd_devs_dbg_read_stack_t *)pkt->data)->fiber_handle);
         unsigned num_fr = 0;
-        for (devs_activation_t *a = fib ? fib->activation : NULL; a; a = a->caller)
+        for (devs_activation_t *a = fib ? fib->activation : NULL; a; a = a->caller) {
+            // the handles are used after resuming (eg. by STEP), when a frame stack slot
+            // could hold another call; heap frames stay put
+            devs_activation_t *p = devs_fiber_promote_frame(ctx, a);
+            if (p)
+                a = p;
             num_fr++;
+        }
         jd_devs_dbg_stackframe_t *data =
             devsdbg_open_results_pipe(cmd, sizeof(jd_devs_dbg_stackframe_t), num_fr);
         if (data) {
@@ -721,6 +860,26 @@ void devsdbg_handle_packet(srv_t *state, jd_packet_t *pkt) {
         step_cmd(cmd);
         break;
 
+    case DEVS_DBG_CMD_PROFILE:
+        profile_cmd(cmd);
+        break;
+
+    case DEVS_DBG_CMD_READ_PROFILE:
+        read_profile(cmd);
+        break;
+
+    case DEVS_DBG_CMD_READ_FIBER_STATS:
+        read_fiber_stats(cmd);
+        break;
+
+    case DEVS_DBG_CMD_READ_REGCACHE_STATS:
+        read_regcache_stats(cmd);
+        break;
+
+    case DEVS_DBG_CMD_READ_ROLE_STATS:
+        read_role_stats(cmd);
+        break;
+
     default:
         switch (service_handle_register_final(state, pkt, devsdbg_regs)) {
         case JD_DEVS_DBG_REG_ENABLED:
@@ -101,6 +101,7 @@ static void send_status(srv_t *state) {
 }
 
 __attribute__((weak)) void devs_panic_handler(int exitcode) {}
+__attribute__((weak)) void devs_profile_handler(devs_ctx_t *ctx) {}
 __attribute__((weak)) void devsdbg_restarted(devs_ctx_t *ctx) {}
 
 static void run_img(srv_t *state, const void *img, unsigned size) {
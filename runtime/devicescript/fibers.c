@@ -9,10 +9,31 @@ void devs_fiber_yield(devs_ctx_t *ctx) {
         devs_trace(ctx, DEVS_TRACE_EV_FIBER_YIELD, &ev, sizeof(ev));
     }
 
+#if DEVS_FIBER_STATS
+    if (ctx->curr_fiber)
+        ctx->curr_fiber->wait_start = devs_now(ctx);
+#endif
     ctx->curr_fn = NULL;
     ctx->curr_fiber = NULL;
 }
 
+void devs_fiber_preempt(devs_ctx_t *ctx) {
+    devs_fiber_t *fiber = ctx->curr_fiber;
+    ctx->preempt_pending = 0;
+    JD_ASSERT(fiber != NULL);
+
+    if (++fiber->num_slices > DEVS_MAX_STEPS / DEVS_SLICE_STEPS) {
+        devs_panic(ctx, DEVS_PANIC_TIMEOUT);
+        return;
+    }
+
+    VLOG("preempt fiber F%d", fiber->bottom_function_idx);
+    // keep it runnable, but let devs_fiber_poke() return, so packets are processed
+    ctx->flags |= DEVS_CTX_PREEMPTED;
+    devs_fiber_set_wake_time(fiber, devs_now(ctx));
+    devs_fiber_yield(ctx);
+}
+
 static void devs_fiber_activate(devs_fiber_t *fiber, devs_activation_t *act) {
     devs_ctx_t *ctx = fiber->ctx;
     fiber->activation = act;
@@ -22,6 +43,91 @@ static void devs_fiber_activate(devs_fiber_t *fiber, devs_activation_t *act) {
     }
 }
 
+#if DEVS_FRAME_STACK_SIZE
+
+STATIC_ASSERT(DEVS_FRAME_STACK_SIZE < 0x10000);
+
+static unsigned frame_size(devs_activation_t *act) {
+    return act->gc.size * JD_PTRSIZE;
+}
+
+// frames on the stack have a header like an activation in GC heap (so the debugger can read them),
+// but marked as scanned, so the GC never touches them; see mark_roots()
+static devs_activation_t *alloc_stack_frame(devs_fiber_t *fiber, unsigned size) {
+    size = (size + sizeof(value_t) - 1) & ~(sizeof(value_t) - 1);
+    if (!fiber->frames) {
+        // the bottom frame goes to the heap
+        if (!fiber->activation)
+            return NULL;
+        fiber->frames = jd_gc_try_alloc_pinned(fiber->ctx->gc, DEVS_FRAME_STACK_SIZE);
+        if (!fiber->frames)
+            return NULL;
+    }
+    if (fiber->frames_top + size > DEVS_FRAME_STACK_SIZE)
+        return NULL;
+    devs_activation_t *act = (void *)(fiber->frames + fiber->frames_top);
+    fiber->frames_top += size;
+    memset(act, 0, size);
+    act->gc.header = DEVS_GC_MK_TAG_WORDS(DEVS_GC_TAG_ACTIVATION | DEVS_GC_TAG_MASK_SCANNED,
+                                          size / JD_PTRSIZE);
+    return act;
+}
+
+// release stack space above the top-most stack frame still in use
+static void pop_stack_frames(devs_fiber_t *fiber) {
+    for (devs_activation_t *act = fiber->activation; act; act = act->caller) {
+        if (devs_fiber_owns_frame(fiber, act)) {
+            fiber->frames_top = (uint8_t *)act - fiber->frames + frame_size(act);
+            return;
+        }
+    }
+    fiber->frames_top = 0;
+}
+
+devs_activation_t *devs_fiber_promote_frame(devs_ctx_t *ctx, devs_activation_t *act) {
+    devs_fiber_t *fiber = ctx->curr_fiber;
+    if (!fiber || !devs_fiber_owns_frame(fiber, act)) {
+        for (fiber = ctx->fibers; fiber; fiber = fiber->next)
+            if (devs_fiber_owns_frame(fiber, act))
+                break;
+        if (!fiber)
+            return act;
+    }
+
+    unsigned size = frame_size(act);
+    devs_activation_t *r = devs_any_try_alloc(ctx, DEVS_GC_TAG_ACTIVATION, size);
+    if (r == NULL)
+        return NULL;
+    memcpy((uint8_t *)r + sizeof(devs_gc_object_t), (uint8_t *)act + sizeof(devs_gc_object_t),
+           size - sizeof(devs_gc_object_t));
+
+    // the only references to the frame are the ones below; the stack space is reclaimed
+    // with pop_stack_frames() when it's callers return
+    if (fiber->activation == act) {
+        fiber->activation = r;
+    } else {
+        for (devs_activation_t *f = fiber->activation; f; f = f->caller)
+            if (f->caller == act) {
+                f->caller = r;
+                break;
+            }
+    }
+    if (ctx->curr_fn == act)
+        ctx->curr_fn = r;
+    if (ctx->step_fn == act)
+        ctx->step_fn = r;
+
+    return r;
+}
+
+#else
+
+devs_activation_t *devs_fiber_promote_frame(devs_ctx_t *ctx, devs_activation_t *act) {
+    return act;
+}
+
+#endif
+
 STATIC_ASSERT(DEVS_MAX_CALL_DEPTH + 10 < 1ULL << (sizeof(((devs_fiber_t *)NULL)->stack_depth) * 8));
 
 int devs_fiber_call_function(devs_fiber_t *fiber, unsigned numparams, devs_array_t *rest) {
@@ -82,10 +188,14 @@ int devs_fiber_call_function(devs_fiber_t *fiber, unsigned numparams, devs_array
     fiber->stack_depth++;
 
     const devs_function_desc_t *func = devs_img_get_function(ctx->img, fidx);
-    devs_activation_t *callee =
-        devs_any_try_alloc(ctx, DEVS_GC_TAG_ACTIVATION,
-                           sizeof(devs_activation_t) + sizeof(value_t) * func->num_slots +
-                               sizeof(devs_pc_t) * func->num_try_frames);
+    unsigned act_size = sizeof(devs_activation_t) + sizeof(value_t) * func->num_slots +
+                        sizeof(devs_pc_t) * func->num_try_frames;
+    devs_activation_t *callee = NULL;
+#if DEVS_FRAME_STACK_SIZE
+    callee = alloc_stack_frame(fiber, act_size);
+#endif
+    if (callee == NULL)
+        callee = devs_any_try_alloc(ctx, DEVS_GC_TAG_ACTIVATION, act_size);
 
     if (callee == NULL)
         return -2;
@@ -96,6 +206,9 @@ int devs_fiber_call_function(devs_fiber_t *fiber, unsigned numparams, devs_array
     callee->maxpc = func->start + func->length;
     callee->caller = fiber->activation;
     callee->func = func;
+#if DEVS_INSN_CACHE_SIZE
+    callee->insns = devs_vm_get_insns(ctx, func);
+#endif
 
     devs_activation_t *caller = fiber->activation;
 
@@ -159,8 +272,234 @@ int devs_fiber_call_function(devs_fiber_t *fiber, unsigned numparams, devs_array
     return 0;
 }
 
+int devs_fiber_tail_call(devs_fiber_t *fiber, unsigned numparams) {
+    devs_activation_t *act = fiber->activation;
+    JD_ASSERT(act->caller != NULL);
+
+    // same as returning; the stack frame (if any) is released and will be reused by the callee
+    fiber->activation = act->caller;
+    fiber->stack_depth--;
+#if DEVS_FRAME_STACK_SIZE
+    pop_stack_frames(fiber);
+#endif
+    act->maxpc = 0;
+#if DEVS_INSN_CACHE_SIZE
+    act->insns = NULL;
+#endif
+    act->caller = NULL;
+
+    return devs_fiber_call_function(fiber, numparams, NULL);
+}
+
+// Fibers with a wake_time are kept in binary min-heaps, one per priority class, so that the next
+// one to run is found in O(log n). Ties go to the fiber started first, as with the list scan
+// the heaps replaced.
+static bool wakes_before(devs_fiber_t *a, devs_fiber_t *b) {
+    if (a->wake_time != b->wake_time)
+        return a->wake_time < b->wake_time;
+    return a->handle_tag < b->handle_tag;
+}
+
+static devs_fiber_t **heap_of(devs_ctx_t *ctx, unsigned prio) {
+    return ctx->sleep_heap + prio * ctx->sleep_heap_size;
+}
+
+static void heap_set(devs_fiber_t **heap, unsigned i, devs_fiber_t *fiber) {
+    heap[i] = fiber;
+    fiber->sleep_idx = i + 1;
+}
+
+static void heap_up(devs_fiber_t **heap, unsigned i) {
+    devs_fiber_t *fiber = heap[i];
+    while (i > 0) {
+        unsigned parent = (i - 1) / 2;
+        if (!wakes_before(fiber, heap[parent]))
+            break;
+        heap_set(heap, i, heap[parent]);
+        i = parent;
+    }
+    heap_set(heap, i, fiber);
+}
+
+static void heap_down(devs_fiber_t **heap, unsigned len, unsigned i) {
+    devs_fiber_t *fiber = heap[i];
+    for (;;) {
+        unsigned child = 2 * i + 1;
+        if (child >= len)
+            break;
+        if (child + 1 < len && wakes_before(heap[child + 1], heap[child]))
+            child++;
+        if (!wakes_before(heap[child], fiber))
+            break;
+        heap_set(heap, i, heap[child]);
+        i = child;
+    }
+    heap_set(heap, i, fiber);
+}
+
+static void heap_insert(devs_ctx_t *ctx, devs_fiber_t *fiber) {
+    devs_fiber_t **heap = heap_of(ctx, fiber->prio);
+    JD_ASSERT(ctx->sleep_heap_len[fiber->prio] < ctx->sleep_heap_size);
+    unsigned i = ctx->sleep_heap_len[fiber->prio]++;
+    heap_set(heap, i, fiber);
+    heap_up(heap, i);
+}
+
+static void heap_remove(devs_ctx_t *ctx, devs_fiber_t *fiber) {
+    devs_fiber_t **heap = heap_of(ctx, fiber->prio);
+    unsigned i = fiber->sleep_idx - 1;
+    fiber->sleep_idx = 0;
+    unsigned len = --ctx->sleep_heap_len[fiber->prio];
+    devs_fiber_t *last = heap[len];
+    if (last != fiber) {
+        heap_set(heap, i, last);
+        heap_up(heap, i);
+        heap_down(heap, len, last->sleep_idx - 1);
+    }
+}
+
+// every heap has room for all fibers, so that setting wake time or priority never allocates
+static bool reserve_sleep_slot(devs_ctx_t *ctx) {
+    if (ctx->num_fibers < ctx->sleep_heap_size)
+        return true;
+    unsigned size = ctx->sleep_heap_size ? ctx->sleep_heap_size * 2 : 8;
+    if (size > 0xffff)
+        return false;
+    devs_fiber_t **heap = devs_try_alloc(ctx, DEVS_FIBER_NUM_PRIO * size * sizeof(devs_fiber_t *));
+    if (heap == NULL)
+        return false;
+    for (unsigned p = 0; p < DEVS_FIBER_NUM_PRIO; ++p)
+        if (ctx->sleep_heap_len[p])
+            memcpy(heap + p * size, heap_of(ctx, p),
+                   ctx->sleep_heap_len[p] * sizeof(devs_fiber_t *));
+    devs_free(ctx, ctx->sleep_heap);
+    ctx->sleep_heap = heap;
+    ctx->sleep_heap_size = size;
+    return true;
+}
+
 void devs_fiber_set_wake_time(devs_fiber_t *fiber, unsigned time) {
+    devs_ctx_t *ctx = fiber->ctx;
     fiber->wake_time = time;
+    if (fiber->sleep_idx) {
+        if (time) {
+            devs_fiber_t **heap = heap_of(ctx, fiber->prio);
+            heap_up(heap, fiber->sleep_idx - 1);
+            heap_down(heap, ctx->sleep_heap_len[fiber->prio], fiber->sleep_idx - 1);
+        } else {
+            heap_remove(ctx, fiber);
+        }
+    } else if (time) {
+        heap_insert(ctx, fiber);
+    }
+}
+
+void devs_fiber_set_priority(devs_fiber_t *fiber, unsigned prio) {
+    JD_ASSERT(prio < DEVS_FIBER_NUM_PRIO);
+    if (fiber->prio == prio)
+        return;
+    devs_ctx_t *ctx = fiber->ctx;
+    bool queued = fiber->sleep_idx != 0;
+    if (queued)
+        heap_remove(ctx, fiber);
+    fiber->prio = prio;
+    if (queued)
+        heap_insert(ctx, fiber);
+}
+
+static devs_fiber_t **fidx_bucket(devs_ctx_t *ctx, unsigned fidx) {
+    return &ctx->fiber_index[fidx & (ctx->fiber_index_size - 1)];
+}
+
+static devs_fiber_t **fidx_bucket_tail(devs_ctx_t *ctx, unsigned fidx) {
+    return &ctx->fiber_index[ctx->fiber_index_size + (fidx & (ctx->fiber_index_size - 1))];
+}
+
+static devs_fiber_t **tag_bucket(devs_ctx_t *ctx, unsigned tag) {
+    return &ctx->fiber_index[2 * ctx->fiber_index_size + (tag & (ctx->fiber_index_size - 1))];
+}
+
+static void index_fiber(devs_ctx_t *ctx, devs_fiber_t *fiber) {
+    // append, so that devs_fiber_by_fidx() returns the oldest fiber, like the list scan did
+    devs_fiber_t **tail = fidx_bucket_tail(ctx, fiber->bottom_function_idx);
+    fiber->fidx_prev = *tail;
+    fiber->fidx_next = NULL;
+    if (*tail)
+        (*tail)->fidx_next = fiber;
+    else
+        *fidx_bucket(ctx, fiber->bottom_function_idx) = fiber;
+    *tail = fiber;
+
+    devs_fiber_t **p = tag_bucket(ctx, fiber->handle_tag);
+    fiber->tag_prev = NULL;
+    fiber->tag_next = *p;
+    if (*p)
+        (*p)->tag_prev = fiber;
+    *p = fiber;
+}
+
+static void unindex_fiber(devs_ctx_t *ctx, devs_fiber_t *fiber) {
+    if (fiber->fidx_prev)
+        fiber->fidx_prev->fidx_next = fiber->fidx_next;
+    else
+        *fidx_bucket(ctx, fiber->bottom_function_idx) = fiber->fidx_next;
+    if (fiber->fidx_next)
+        fiber->fidx_next->fidx_prev = fiber->fidx_prev;
+    else
+        *fidx_bucket_tail(ctx, fiber->bottom_function_idx) = fiber->fidx_prev;
+
+    if (fiber->tag_prev)
+        fiber->tag_prev->tag_next = fiber->tag_next;
+    else
+        *tag_bucket(ctx, fiber->handle_tag) = fiber->tag_next;
+    if (fiber->tag_next)
+        fiber->tag_next->tag_prev = fiber->tag_prev;
+}
+
+// keep at least as many buckets as fibers
+static bool reserve_index_slot(devs_ctx_t *ctx) {
+    if (ctx->num_fibers < ctx->fiber_index_size)
+        return true;
+    unsigned size = ctx->fiber_index_size ? ctx->fiber_index_size * 2 : 8;
+    if (size > 0x8000)
+        return false;
+    devs_fiber_t **index = devs_try_alloc(ctx, 3 * size * sizeof(devs_fiber_t *));
+    if (index == NULL)
+        return false;
+    devs_free(ctx, ctx->fiber_index);
+    ctx->fiber_index = index;
+    ctx->fiber_index_size = size;
+    for (devs_fiber_t *fiber = ctx->fibers; fiber; fiber = fiber->next)
+        index_fiber(ctx, fiber);
+    return true;
+}
+
+void devs_fiber_add_ready(devs_fiber_t *fiber) {
+    if (fiber->in_ready_list)
+        return;
+    // keep it in arrival order
+    devs_ctx_t *ctx = fiber->ctx;
+    fiber->ready_prev = ctx->ready_tail;
+    fiber->ready_next = NULL;
+    if (ctx->ready_tail)
+        ctx->ready_tail->ready_next = fiber;
+    else
+        ctx->ready_list = fiber;
+    ctx->ready_tail = fiber;
+    fiber->in_ready_list = 1;
+}
+
+static void remove_ready(devs_ctx_t *ctx, devs_fiber_t *fiber) {
+    if (fiber->ready_prev)
+        fiber->ready_prev->ready_next = fiber->ready_next;
+    else
+        ctx->ready_list = fiber->ready_next;
+    if (fiber->ready_next)
+        fiber->ready_next->ready_prev = fiber->ready_prev;
+    else
+        ctx->ready_tail = fiber->ready_prev;
+    fiber->ready_next = fiber->ready_prev = NULL;
+    fiber->in_ready_list = 0;
 }
 
 void devs_fiber_sleep(devs_fiber_t *fiber, unsigned time) {
@@ -172,6 +511,7 @@ void devs_fiber_sleep(devs_fiber_t *fiber, unsigned time) {
             wake = 0xffffffff;
     }
     devs_fiber_set_wake_time(fiber, wake);
+    fiber->num_slices = 0;
     devs_fiber_yield(fiber->ctx);
 }
 
@@ -179,6 +519,7 @@ void devs_fiber_await(devs_fiber_t *fib, uint8_t *awaiting) {
     *awaiting = 0;
     fib->pkt_kind = DEVS_PKT_KIND_AWAITING;
     fib->pkt_data.awaiting = awaiting;
+    devs_fiber_add_ready(fib);
     devs_fiber_sleep(fib, 0xffffffff);
 }
 
@@ -190,15 +531,23 @@ void devs_fiber_await_done(uint8_t *awaiting) {
 static void free_fiber(devs_fiber_t *fiber) {
     devs_jd_clear_pkt_kind(fiber);
     devs_ctx_t *ctx = fiber->ctx;
-    if (ctx->fibers == fiber) {
+#if DEVS_FRAME_STACK_SIZE
+    devs_free(ctx, fiber->frames);
+#endif
+    if (fiber->sleep_idx)
+        heap_remove(ctx, fiber);
+    if (fiber->in_ready_list)
+        remove_ready(ctx, fiber);
+    unindex_fiber(ctx, fiber);
+    ctx->num_fibers--;
+    if (fiber->prev)
+        fiber->prev->next = fiber->next;
+    else
         ctx->fibers = fiber->next;
-    } else {
-        devs_fiber_t *f = ctx->fibers;
-        while (f && f->next != fiber)
-            f = f->next;
-        JD_ASSERT(f != NULL);
-        f->next = fiber->next;
-    }
+    if (fiber->next)
+        fiber->next->prev = fiber->prev;
+    else
+        ctx->fibers_tail = fiber->prev;
     devs_free(ctx, fiber);
 }
 
@@ -214,7 +563,13 @@ void devs_fiber_return_from_call(devs_fiber_t *fiber, devs_activation_t *act) {
             fiber->ret_val = act->slots[0];
         devs_fiber_activate(fiber, act->caller);
         fiber->stack_depth--;
+#if DEVS_FRAME_STACK_SIZE
+        pop_stack_frames(fiber);
+#endif
         act->maxpc = 0; // protect against re-activation
+#if DEVS_INSN_CACHE_SIZE
+        act->insns = NULL;
+#endif
         // act may survive as a closure past the caller intended lifetime
         act->caller = NULL;
     } else {
@@ -236,9 +591,23 @@ void devs_fiber_free_all_fibers(devs_ctx_t *ctx) {
     while (f) {
         ctx->fibers = f->next;
         devs_jd_clear_pkt_kind(f);
+#if DEVS_FRAME_STACK_SIZE
+        devs_free(ctx, f->frames);
+#endif
         devs_free(ctx, f);
         f = ctx->fibers;
     }
+    devs_free(ctx, ctx->sleep_heap);
+    ctx->sleep_heap = NULL;
+    ctx->sleep_heap_size = 0;
+    memset(ctx->sleep_heap_len, 0, sizeof(ctx->sleep_heap_len));
+    ctx->num_fibers = 0;
+    ctx->ready_list = NULL;
+    ctx->ready_tail = NULL;
+    ctx->fibers_tail = NULL;
+    devs_free(ctx, ctx->fiber_index);
+    ctx->fiber_index = NULL;
+    ctx->fiber_index_size = 0;
 }
 
 const char *devs_img_fun_name(devs_img_t img, unsigned fidx) {
@@ -256,14 +625,18 @@ const char *devs_img_fun_name(devs_img_t img, unsigned fidx) {
 }
 
 devs_fiber_t *devs_fiber_by_fidx(devs_ctx_t *ctx, unsigned fidx) {
-    for (devs_fiber_t *fiber = ctx->fibers; fiber; fiber = fiber->next)
+    if (!ctx->fiber_index)
+        return NULL;
+    for (devs_fiber_t *fiber = *fidx_bucket(ctx, fidx); fiber; fiber = fiber->fidx_next)
         if (fiber->bottom_function_idx == fidx)
             return fiber;
     return NULL;
 }
 
 devs_fiber_t *devs_fiber_by_tag(devs_ctx_t *ctx, unsigned tag) {
-    for (devs_fiber_t *fiber = ctx->fibers; fiber; fiber = fiber->next)
+    if (!ctx->fiber_index)
+        return NULL;
+    for (devs_fiber_t *fiber = *tag_bucket(ctx, tag); fiber; fiber = fiber->tag_next)
         if (fiber->handle_tag == tag)
             return fiber;
     return NULL;
@@ -301,25 +674,33 @@ devs_fiber_t *devs_fiber_start(devs_ctx_t *ctx, unsigned numargs, unsigned op) {
         }
     }
 
+    if (!reserve_sleep_slot(ctx) || !reserve_index_slot(ctx))
+        return NULL;
     fiber = devs_try_alloc(ctx, sizeof(*fiber));
     if (fiber == NULL)
         return NULL;
     fiber->ctx = ctx;
+    ctx->num_fibers++;
     fiber->bottom_function_idx = fidx;
     fiber->handle_tag = ++ctx->fiber_handle_tag;
+    fiber->prio = DEVS_FIBER_PRIO_DEFAULT;
+#if DEVS_FIBER_STATS
+    fiber->wait_start = devs_now(ctx);
+#endif
 
     log_fiber_op(fiber, "start");
 
     // link fiber first, so activation linked to it are marked in GC
     // also link it last
-    devs_fiber_t *last = ctx->fibers;
+    devs_fiber_t *last = ctx->fibers_tail;
     if (last) {
-        while (last->next)
-            last = last->next;
         last->next = fiber;
+        fiber->prev = last;
     } else {
         ctx->fibers = fiber;
     }
+    ctx->fibers_tail = fiber;
+    index_fiber(ctx, fiber);
 
     devs_fiber_call_function(fiber, numargs, NULL);
 
@@ -345,6 +726,13 @@ void devs_fiber_run(devs_fiber_t *fiber) {
     if (!devs_jd_should_run(fiber))
         return;
 
+#if DEVS_FIBER_STATS
+    if (fiber->pkt_kind < DEVS_PKT_KIND_NUM)
+        fiber->stats.wait_ms[fiber->pkt_kind] += devs_now(ctx) - fiber->wait_start;
+    uint32_t tag = fiber->handle_tag;
+    uint64_t t0 = tim_get_micros();
+#endif
+
     devs_jd_clear_pkt_kind(fiber);
     fiber->role_idx = DEVS_NO_ROLE;
     devs_fiber_set_wake_time(fiber, 0);
@@ -365,7 +753,24 @@ void devs_fiber_run(devs_fiber_t *fiber) {
         cb(ctx, data);
     }
 
+#if DEVS_FIBER_STATS
+    unsigned steps = devs_vm_exec_opcodes(ctx);
+    // the fiber may have finished or been terminated
+    fiber = devs_fiber_by_tag(ctx, tag);
+    if (fiber) {
+        fiber->stats.steps += steps;
+        fiber->stats.run_us += tim_get_micros() - t0;
+        if (devs_trace_enabled(ctx)) {
+            devs_trace_ev_fiber_stats_t ev = {.handle_tag = tag,
+                                              .steps = fiber->stats.steps,
+                                              .run_us = fiber->stats.run_us,
+                                              .alloc_bytes = fiber->stats.alloc_bytes};
+            devs_trace(ctx, DEVS_TRACE_EV_FIBER_STATS, &ev, sizeof(ev));
+        }
+    }
+#else
     devs_vm_exec_opcodes(ctx);
+#endif
 }
 
 void devs_panic(devs_ctx_t *ctx, unsigned code) {
@@ -431,39 +836,70 @@ unsigned devs_fiber_get_max_sleep(devs_ctx_t *ctx) {
     int min_ms = 100;
     uint32_t now_ = devs_now(ctx);
 
-    for (devs_fiber_t *fiber = ctx->fibers; fiber; fiber = fiber->next) {
-        if (fiber->wake_time) {
-            int d = fiber->wake_time - now_;
-            if (d < 0)
-                d = 0;
-            if (d < min_ms)
-                min_ms = d;
-        }
+    for (unsigned p = 0; p < DEVS_FIBER_NUM_PRIO; ++p) {
+        if (!ctx->sleep_heap_len[p])
+            continue;
+        int d = heap_of(ctx, p)[0]->wake_time - now_;
+        if (d < 0)
+            d = 0;
+        if (d < min_ms)
+            min_ms = d;
     }
+#if DEVS_TX_BATCH_FRAMES
+    // jd_send_pkt() failed in devs_jd_flush_tx(); try again soon
+    if (ctx->tx_batch && ctx->tx_batch->num_frames && min_ms > 3)
+        min_ms = 3;
+#endif
     return min_ms * 1000;
 }
 
+// Picks the due fiber of the highest priority class. A due fiber of a lower class that
+// has waited DEVS_FIBER_AGING_MS past its wake time is run first, so that a busy handler
+// class cannot starve background loops.
+static devs_fiber_t *next_sleeper(devs_ctx_t *ctx, uint32_t now_) {
+    devs_fiber_t *best = NULL;
+    devs_fiber_t *aged = NULL;
+    for (int p = DEVS_FIBER_NUM_PRIO - 1; p >= 0; --p) {
+        if (!ctx->sleep_heap_len[p])
+            continue;
+        devs_fiber_t *top = heap_of(ctx, p)[0];
+        if (top->wake_time > now_)
+            continue;
+        if (!best)
+            best = top;
+        else if (now_ - top->wake_time >= DEVS_FIBER_AGING_MS &&
+                 (!aged || top->wake_time < aged->wake_time))
+            aged = top;
+    }
+    return aged ? aged : best;
+}
+
 static int devs_fiber_wake_some(devs_ctx_t *ctx) {
     if (devs_is_suspended(ctx))
         return 0;
     uint32_t now_ = devs_now(ctx);
     devs_fiber_t *fibmin = NULL;
 
-    for (devs_fiber_t *fiber = ctx->fibers; fiber; fiber = fiber->next) {
-        if (fiber->role_wkp ||
-            (fiber->pkt_kind == DEVS_PKT_KIND_AWAITING && *fiber->pkt_data.awaiting)) {
+    devs_fiber_t *next;
+    for (devs_fiber_t *fiber = ctx->ready_list; fiber; fiber = next) {
+        next = fiber->ready_next;
+        bool awaiting = fiber->pkt_kind == DEVS_PKT_KIND_AWAITING;
+        if (fiber->role_wkp || (awaiting && *fiber->pkt_data.awaiting)) {
             fibmin = fiber;
             break;
         }
-
-        if (fiber->wake_time && fiber->wake_time <= now_) {
-            if (fibmin == NULL || fibmin->wake_time > fiber->wake_time)
-                fibmin = fiber;
-        }
+        // drop it if role_wkp was cleared, or the wait was cancelled
+        if (!awaiting)
+            remove_ready(ctx, fiber);
     }
 
-    if (!fibmin)
-        return 0;
+    if (fibmin) {
+        remove_ready(ctx, fibmin);
+    } else {
+        fibmin = next_sleeper(ctx, now_);
+        if (!fibmin)
+            return 0;
+    }
 
     devs_jd_reset_packet(ctx);
     devs_fiber_run(fibmin);
@@ -473,16 +909,28 @@ static int devs_fiber_wake_some(devs_ctx_t *ctx) {
 }
 
 static void devs_print_warnings(devs_ctx_t *ctx) {
-    if (ctx->num_throttled_pkts) {
-        DMESG("%u packets throttled", (unsigned)ctx->num_throttled_pkts);
-        ctx->num_throttled_pkts = 0;
+    devs_jd_print_throttled(ctx);
+
+    devs_regcache_t *cache = &ctx->regcache;
+    uint32_t lookups = cache->stats.hits + cache->stats.misses;
+    if (lookups != cache->traced_lookups) {
+        cache->traced_lookups = lookups;
+        devs_trace(ctx, DEVS_TRACE_EV_REGCACHE_STATS, &cache->stats, sizeof(cache->stats));
     }
 }
 
 void devs_fiber_poke(devs_ctx_t *ctx) {
     devs_fiber_sync_now(ctx);
-    while (devs_fiber_wake_some(ctx))
-        ;
+    ctx->flags &= ~DEVS_CTX_PREEMPTED;
+    while (devs_fiber_wake_some(ctx)) {
+        if (ctx->flags & DEVS_CTX_PREEMPTED) {
+            // the fiber is still runnable, so devs_fiber_get_max_sleep() will get us back here
+            ctx->flags &= ~DEVS_CTX_PREEMPTED;
+            break;
+        }
+    }
+
+    devs_jd_flush_tx(ctx);
 
     if (devs_now(ctx) > ctx->last_warning + 5 * 1024) {
         ctx->last_warning = devs_now(ctx);
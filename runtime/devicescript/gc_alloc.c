@@ -33,6 +33,14 @@ void devs_gc_obj_check_core(devs_gc_t *gc, const void *ptr);
 
 #define FREE_FILL 0x37
 
+// free blocks are kept in exact size classes for 2..GC_EXACT_WORDS words,
+// and in power-of-two bins above that (the last bin takes everything bigger)
+#define GC_EXACT_WORDS 16
+#define GC_NUM_BINS (GC_EXACT_WORDS - 1 + 20)
+
+// bucket i counts allocations taking [2^(i-1), 2^i) us; bucket 0 is under 1us
+#define GC_LATENCY_BUCKETS 16
+
 typedef struct _free_devs_gc_block_t {
     devs_gc_object_t gc;
     struct _devs_gc_block_t *next;
@@ -52,6 +60,7 @@ typedef struct _devs_gc_block_t {
         devs_gimage_t image;
         devs_map_t map;
         devs_short_map_t short_map;
+        devs_map_shape_t shape;
         devs_activation_t act;
         devs_bound_function_t bound_function;
         devs_packet_t pkt;
@@ -65,12 +74,16 @@ typedef struct _devs_gc_chunk_t {
 } chunk_t;
 
 struct _devs_gc_t {
-    block_t *first_free;
+    block_t *free_bins[GC_NUM_BINS];
     chunk_t *first_chunk;
     uint32_t num_alloc;
     uint32_t gc_threshold;
     uint32_t curr_alloc;
     devs_ctx_t *ctx;
+    uint32_t num_gcs;
+    // only updated with DEVS_FLAG_VM_STATS
+    uint32_t max_alloc_us;
+    uint32_t alloc_latency[GC_LATENCY_BUCKETS];
 };
 
 static inline void mark_block(devs_gc_t *gc, block_t *block, unsigned tag, unsigned size) {
@@ -88,6 +101,22 @@ static inline uintptr_t *block_ptr(block_t *block) {
     return (uintptr_t *)block;
 }
 
+static unsigned bin_of(unsigned words) {
+    if (words <= GC_EXACT_WORDS)
+        return words - 2;
+    unsigned bin = GC_EXACT_WORDS - 1;
+    for (unsigned w = words >> 5; w; w >>= 1)
+        bin++;
+    return bin < GC_NUM_BINS ? bin : GC_NUM_BINS - 1;
+}
+
+static void add_free_block(devs_gc_t *gc, block_t *block, unsigned words) {
+    mark_block(gc, block, DEVS_GC_TAG_FREE, words);
+    block_t **head = &gc->free_bins[bin_of(words)];
+    block->free.next = *head;
+    *head = block;
+}
+
 void devs_gc_add_chunk(devs_gc_t *gc, void *start, unsigned size) {
     JD_ASSERT(size > sizeof(chunk_t) + 128);
     chunk_t *ch = start;
@@ -135,6 +164,15 @@ static void mark_ptr(devs_ctx_t *ctx, void *ptr) {
     b->header |= (uintptr_t)DEVS_GC_TAG_MASK_SCANNED << DEVS_GC_TAG_POS;
 }
 
+// for blocks that can be referenced from more than one object
+static void mark_shared_ptr(devs_ctx_t *ctx, void *ptr) {
+    if (ptr) {
+        block_t *b = (block_t *)((uintptr_t *)ptr - 1);
+        if (!(GET_TAG(b->header) & DEVS_GC_TAG_MASK_SCANNED))
+            mark_ptr(ctx, ptr);
+    }
+}
+
 static void scan_array_and_mark(devs_ctx_t *ctx, value_t *vals, unsigned length, int depth) {
     if (vals) {
         LOGV("arr %p %u", vals, length);
@@ -162,6 +200,7 @@ static void scan_gc_obj(devs_ctx_t *ctx, block_t *block, int depth) {
         block->header &= ~((uintptr_t)DEVS_GC_TAG_MASK_PENDING << DEVS_GC_TAG_POS);
 
         devs_map_t *map = NULL;
+        block_t *next = NULL;
 
         switch (BASIC_TAG(header)) {
         case DEVS_GC_TAG_BUFFER:
@@ -188,6 +227,14 @@ static void scan_gc_obj(devs_ctx_t *ctx, block_t *block, int depth) {
             scan_value(ctx, block->bound_function.this_val, depth);
             scan_value(ctx, block->bound_function.func, depth);
             break;
+        case DEVS_GC_TAG_SHAPE:
+            // keys are static strings, see devs_shape_transition()
+            mark_shared_ptr(ctx, block->shape.keys);
+            mark_shared_ptr(ctx, block->shape.index);
+            // children are weak (see clear_dead_shapes()); parent chains can be long, so they
+            // are followed in this loop, without using up depth
+            next = (block_t *)block->shape.parent;
+            break;
         case DEVS_GC_TAG_ACTIVATION:
             scan_gc_obj(ctx, (void *)block->act.closure, depth);
             scan_array(ctx, block->act.slots, block->act.func->num_slots, depth);
@@ -205,15 +252,20 @@ static void scan_gc_obj(devs_ctx_t *ctx, block_t *block, int depth) {
 
         if (map) {
             unsigned len = map->length;
-            if (BASIC_TAG(header) != DEVS_GC_TAG_SHORT_MAP)
+            if (BASIC_TAG(header) == DEVS_GC_TAG_SHORT_MAP) {
+                // no shape
+            } else if (map->shape) {
+                scan_gc_obj(ctx, (block_t *)map->shape, depth);
+            } else {
                 len *= 2;
+            }
             scan_array_and_mark(ctx, map->data, len, depth);
             if (devs_maplike_is_map(ctx, map->proto))
                 block = (void *)map->proto;
             else
                 break;
         } else {
-            break;
+            block = next;
         }
     }
 }
@@ -246,6 +298,7 @@ static void mark_roots(devs_gc_t *gc) {
     scan_gc_obj(ctx, (block_t *)ctx->fn_protos, ROOT_SCAN_DEPTH);
     scan_gc_obj(ctx, (block_t *)ctx->fn_values, ROOT_SCAN_DEPTH);
     scan_gc_obj(ctx, (block_t *)ctx->spec_protos, ROOT_SCAN_DEPTH);
+    scan_gc_obj(ctx, (block_t *)ctx->root_shape, ROOT_SCAN_DEPTH);
     scan_value(ctx, ctx->exn_val, ROOT_SCAN_DEPTH);
     scan_value(ctx, ctx->diag_field, ROOT_SCAN_DEPTH);
 
@@ -254,7 +307,13 @@ static void mark_roots(devs_gc_t *gc) {
         if (devs_fiber_uses_pkt_data_v(fib))
             scan_value(ctx, fib->pkt_data.v, ROOT_SCAN_DEPTH);
         for (devs_activation_t *act = fib->activation; act; act = act->caller) {
-            scan_gc_obj(ctx, (void *)act, ROOT_SCAN_DEPTH);
+            if (devs_fiber_owns_frame(fib, act)) {
+                // not a heap block; the frame stack itself is pinned
+                scan_gc_obj(ctx, (void *)act->closure, ROOT_SCAN_DEPTH);
+                scan_array(ctx, act->slots, act->func->num_slots, ROOT_SCAN_DEPTH);
+            } else {
+                scan_gc_obj(ctx, (void *)act, ROOT_SCAN_DEPTH);
+            }
         }
     }
 }
@@ -276,18 +335,57 @@ static inline bool can_free(uintptr_t header) {
            (tag & (DEVS_GC_TAG_MASK_SCANNED | DEVS_GC_TAG_MASK_PINNED)) == 0;
 }
 
+// unlinks shapes about to be freed from their parents; the root is always live, and so are
+// the ancestors of a live shape, so only the live part of the tree is walked
+static void clear_dead_shapes(devs_ctx_t *ctx) {
+    devs_map_shape_t *root = ctx->root_shape;
+    if (!root)
+        return;
+
+    unsigned num_live = 0;
+    devs_map_shape_t *sh = root;
+    for (;;) {
+        num_live++;
+        devs_map_shape_t **pp = &sh->first_child;
+        while (*pp) {
+            if (can_free((*pp)->gc.header)) {
+                *pp = (*pp)->next_sibling;
+                sh->num_children--;
+            } else {
+                pp = &(*pp)->next_sibling;
+            }
+        }
+
+        // pre-order walk, without a stack
+        if (sh->first_child) {
+            sh = sh->first_child;
+            continue;
+        }
+        while (sh != root && !sh->next_sibling)
+            sh = sh->parent;
+        if (sh == root)
+            break;
+        sh = sh->next_sibling;
+    }
+    ctx->num_shapes = num_live;
+}
+
 static void clear_weak_pointers(devs_ctx_t *ctx) {
     if (!ctx)
         return;
 
     if (ctx->step_fn && can_free(ctx->step_fn->gc.header))
         ctx->step_fn = NULL;
+
+    clear_dead_shapes(ctx);
 }
 
 static void sweep(devs_gc_t *gc) {
     int sweep = 0;
-    block_t *prev = NULL;
-    gc->first_free = NULL;
+    // bins are rebuilt in address order
+    block_t *tails[GC_NUM_BINS];
+    memset(tails, 0, sizeof(tails));
+    memset(gc->free_bins, 0, sizeof(gc->free_bins));
     gc->curr_alloc = 0;
 
     for (;;) {
@@ -321,13 +419,14 @@ static void sweep(devs_gc_t *gc) {
                     if (p != block) {
                         unsigned new_size = block_ptr(p) - block_ptr(block);
                         mark_block(gc, block, DEVS_GC_TAG_FREE, new_size);
-                        if (prev == NULL) {
-                            gc->first_free = block;
+                        unsigned bin = bin_of(new_size);
+                        if (tails[bin] == NULL) {
+                            gc->free_bins[bin] = block;
                         } else {
-                            prev->free.next = block;
+                            tails[bin]->free.next = block;
                         }
                         block->free.next = NULL;
-                        prev = block;
+                        tails[bin] = block;
                     } else {
                         block->header = block->header &
                                         ~((uintptr_t)DEVS_GC_TAG_MASK_SCANNED << DEVS_GC_TAG_POS);
@@ -369,41 +468,86 @@ static void validate_heap(devs_gc_t *gc) {
 
 static void devs_gc(devs_gc_t *gc) {
     LOG("*** GC");
+#if DEVS_FIBER_STATS
+    if (gc->ctx && gc->ctx->curr_fiber)
+        gc->ctx->curr_fiber->stats.num_gcs++;
+#endif
+    gc->num_gcs++;
     mark_roots(gc);
     sweep(gc);
 }
 
 static block_t *find_free_block(devs_gc_t *gc, unsigned tag, uint32_t words) {
-    block_t *prev = NULL;
-    for (block_t *b = gc->first_free; b; prev = b, b = b->free.next) {
-        unsigned bsz = block_size(b);
-        int left = bsz - words;
-        if (left < 0)
-            continue;
-
-        block_t *next;
-        if (left > 2) {
-            // split block
-            mark_block(gc, b, tag, words);
-            next = next_block(b);
-            // mark_block() below can overwrite b->free.next when words==0, so do this first
-            next->free.next = b->free.next;
-            mark_block(gc, next, DEVS_GC_TAG_FREE, left);
-        } else {
-            mark_block(gc, b, tag, block_size(b));
-            next = b->free.next;
+    unsigned bin = bin_of(words);
+    block_t *b = NULL;
+
+    if (bin >= GC_EXACT_WORDS - 1) {
+        // blocks in a power-of-two bin can be smaller than requested
+        for (block_t **p = &gc->free_bins[bin]; *p; p = &(*p)->free.next) {
+            if (block_size(*p) >= words) {
+                b = *p;
+                *p = b->free.next;
+                break;
+            }
         }
+        bin++;
+    }
 
-        if (prev == NULL) {
-            gc->first_free = next;
-        } else {
-            prev->free.next = next;
-        }
+    // any block in the remaining bins fits
+    for (; !b && bin < GC_NUM_BINS; ++bin) {
+        b = gc->free_bins[bin];
+        if (b)
+            gc->free_bins[bin] = b->free.next;
+    }
+
+    if (!b)
+        return NULL;
 
-        return b;
+    unsigned left = block_size(b) - words;
+    if (left > 2) {
+        // split block
+        mark_block(gc, b, tag, words);
+        add_free_block(gc, next_block(b), left);
+    } else {
+        mark_block(gc, b, tag, block_size(b));
     }
 
-    return NULL;
+    return b;
+}
+
+static void record_alloc_latency(devs_gc_t *gc, uint32_t us) {
+    unsigned bucket = 0;
+    for (uint32_t v = us; v; v >>= 1)
+        bucket++;
+    if (bucket >= GC_LATENCY_BUCKETS)
+        bucket = GC_LATENCY_BUCKETS - 1;
+    gc->alloc_latency[bucket]++;
+    if (us > gc->max_alloc_us)
+        gc->max_alloc_us = us;
+}
+
+// upper bound (in us) of the latency of pct% of allocations
+static unsigned alloc_latency_percentile(devs_gc_t *gc, uint32_t total, unsigned pct) {
+    uint64_t limit = (uint64_t)total * pct;
+    uint64_t sum = 0;
+    for (unsigned i = 0; i < GC_LATENCY_BUCKETS; ++i) {
+        sum += (uint64_t)gc->alloc_latency[i] * 100;
+        if (sum >= limit)
+            return 1U << i;
+    }
+    return 1U << (GC_LATENCY_BUCKETS - 1);
+}
+
+void devs_gc_dump_stats(devs_gc_t *gc) {
+    uint32_t total = 0;
+    for (unsigned i = 0; i < GC_LATENCY_BUCKETS; ++i)
+        total += gc->alloc_latency[i];
+    if (!total)
+        return;
+    DMESG("gc-stats: %u allocs, %u GCs, latency p50<%uus p90<%uus p99<%uus max %uus",
+          (unsigned)total, (unsigned)gc->num_gcs, alloc_latency_percentile(gc, total, 50),
+          alloc_latency_percentile(gc, total, 90), alloc_latency_percentile(gc, total, 99),
+          (unsigned)gc->max_alloc_us);
 }
 
 static block_t *alloc_block(devs_gc_t *gc, unsigned tag, unsigned size) {
@@ -443,11 +587,19 @@ static block_t *alloc_block(devs_gc_t *gc, unsigned tag, unsigned size) {
 void *jd_gc_any_try_alloc(devs_gc_t *gc, unsigned tag, uint32_t size) {
     if (size > DEVS_MAX_ALLOC)
         return NULL;
+    bool stats = devs_get_global_flags() & DEVS_FLAG_VM_STATS;
+    uint64_t t0 = stats ? tim_get_micros() : 0;
     block_t *b = alloc_block(gc, tag, size);
+    if (stats)
+        record_alloc_latency(gc, tim_get_micros() - t0);
     if (!b)
         return NULL;
     memset(b->data, 0x00, size - JD_PTRSIZE);
     LOG("alloc: tag=%s sz=%d -> %p", devs_gc_tag_name(tag), (int)size, b);
+#if DEVS_FIBER_STATS
+    if (gc->ctx && gc->ctx->curr_fiber)
+        gc->ctx->curr_fiber->stats.alloc_bytes += size;
+#endif
     return b;
 }
 
@@ -458,6 +610,14 @@ void *devs_any_try_alloc(devs_ctx_t *ctx, unsigned tag, unsigned size) {
     return r;
 }
 
+void *jd_gc_try_alloc_pinned(devs_gc_t *gc, uint32_t size) {
+    uintptr_t *r =
+        jd_gc_any_try_alloc(gc, DEVS_GC_TAG_MASK_PINNED | DEVS_GC_TAG_BYTES, size + JD_PTRSIZE);
+    if (r)
+        return r + 1;
+    return NULL;
+}
+
 void *devs_try_alloc(devs_ctx_t *ctx, uint32_t size) {
     uintptr_t *r =
         devs_any_try_alloc(ctx, DEVS_GC_TAG_MASK_PINNED | DEVS_GC_TAG_BYTES, size + JD_PTRSIZE);
@@ -516,9 +676,12 @@ void devs_value_unpin(devs_ctx_t *ctx, value_t v) {
 }
 
 devs_map_t *devs_map_try_alloc(devs_ctx_t *ctx, devs_maplike_t *proto) {
+    devs_map_shape_t *sh = devs_shape_root(ctx);
     devs_map_t *m = devs_any_try_alloc(ctx, DEVS_GC_TAG_MAP, sizeof(devs_map_t));
-    if (m)
+    if (m) {
         m->proto = proto;
+        m->shape = sh;
+    }
     return m;
 }
 
@@ -667,7 +830,9 @@ static const char *tags[] = {
     "half_static_map", //
     "short_map",       //
     "packet",          //
-    "string_jmp"       //
+    "string_jmp",      //
+    "image",           //
+    "shape",           //
 };
 
 const char *devs_gc_tag_name(unsigned tag) {
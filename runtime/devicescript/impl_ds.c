@@ -164,7 +164,8 @@ void fun2_DeviceScript__serverSend(devs_ctx_t *ctx) {
 
     pkt->service_index = service_idx;
 
-    unsigned sz = pkt->payload->length;
+    unsigned sz;
+    uint8_t *data = devs_packet_data(pkt, &sz);
 
     if (sz > JD_SERIAL_PAYLOAD_SIZE) {
         devs_throw_too_big_error(ctx, DEVS_BUILTIN_STRING_PACKET);
@@ -177,7 +178,7 @@ void fun2_DeviceScript__serverSend(devs_ctx_t *ctx) {
     ctx->packet.flags = pkt->flags;
 
     ctx->packet.service_size = sz;
-    memcpy(ctx->packet.data, pkt->payload->data, sz);
+    memcpy(ctx->packet.data, data, sz);
 
     devs_jd_send_raw(ctx);
 }
@@ -22,6 +22,44 @@ value_t prop_DsFiber_suspended(devs_ctx_t *ctx, value_t self) {
     return fib ? devs_value_from_bool(fib->pkt_kind == DEVS_PKT_KIND_SUSPENDED) : devs_undefined;
 }
 
+#if DEVS_FIBER_STATS
+static const uint16_t wait_names[DEVS_PKT_KIND_NUM] = {
+    DEVS_BUILTIN_STRING_WAITSLEEP,     DEVS_BUILTIN_STRING_WAITREGGET,
+    DEVS_BUILTIN_STRING_WAITSEND,      DEVS_BUILTIN_STRING_WAITSENDRAW,
+    DEVS_BUILTIN_STRING_WAITSUSPENDED, DEVS_BUILTIN_STRING_WAITAWAITING};
+
+static void set_stat(devs_ctx_t *ctx, devs_map_t *m, unsigned name, uint32_t v) {
+    devs_map_set_string_field(ctx, m, name, devs_value_from_double(v));
+}
+#endif
+
+// { steps, runTime (us), allocated (bytes), gcs, waitSleep (ms), waitRegGet (ms), ... }
+// the current run of the calling fiber is not included
+value_t prop_DsFiber_stats(devs_ctx_t *ctx, value_t self) {
+    devs_fiber_t *f = fiber_self(ctx, self);
+    if (!f)
+        return devs_undefined;
+#if DEVS_FIBER_STATS
+    devs_fiber_stats_t st = f->stats;
+    devs_map_t *m =
+        devs_map_try_alloc(ctx, devs_get_builtin_object(ctx, DEVS_BUILTIN_OBJECT_OBJECT_PROTOTYPE));
+    if (!m)
+        return devs_undefined;
+    value_t r = devs_value_from_gc_obj(ctx, m);
+    devs_value_pin(ctx, r);
+    set_stat(ctx, m, DEVS_BUILTIN_STRING_STEPS, st.steps);
+    set_stat(ctx, m, DEVS_BUILTIN_STRING_RUNTIME, st.run_us);
+    set_stat(ctx, m, DEVS_BUILTIN_STRING_ALLOCATED, st.alloc_bytes);
+    set_stat(ctx, m, DEVS_BUILTIN_STRING_GCS, st.num_gcs);
+    for (unsigned i = 0; i < DEVS_PKT_KIND_NUM; ++i)
+        set_stat(ctx, m, wait_names[i], st.wait_ms[i]);
+    devs_value_unpin(ctx, r);
+    return r;
+#else
+    return devs_undefined;
+#endif
+}
+
 static devs_fiber_t *devs_arg_self_fiber(devs_ctx_t *ctx) {
     return fiber_self(ctx, devs_arg_self(ctx));
 }
@@ -46,6 +84,23 @@ void meth0_DsFiber_terminate(devs_ctx_t *ctx) {
     devs_fiber_termiante(fib);
 }
 
+value_t prop_DsFiber_priority(devs_ctx_t *ctx, value_t self) {
+    devs_fiber_t *fib = fiber_self(ctx, self);
+    return fib ? devs_value_from_int(fib->prio) : devs_undefined;
+}
+
+void meth1_DsFiber_setPriority(devs_ctx_t *ctx) {
+    devs_fiber_t *fib = devs_arg_self_fiber(ctx);
+    if (!fib)
+        return;
+    int prio = devs_arg_int(ctx, 0);
+    if (prio < 0 || prio >= DEVS_FIBER_NUM_PRIO) {
+        devs_throw_range_error(ctx, "invalid fiber priority");
+        return;
+    }
+    devs_fiber_set_priority(fib, prio);
+}
+
 void fun1_DeviceScript_suspend(devs_ctx_t *ctx) {
     devs_fiber_t *fib = ctx->curr_fiber;
     unsigned sleep = devs_compute_timeout(ctx, devs_arg(ctx, 0));
@@ -59,9 +59,21 @@ value_t prop_DsPacket_isReport(devs_ctx_t *ctx, value_t self) {
     return devs_value_from_bool(!(pkt->flags & JD_FRAME_FLAG_COMMAND));
 }
 
+devs_buffer_t *devs_packet_payload(devs_ctx_t *ctx, devs_packet_t *pkt) {
+    if (!pkt->payload) {
+        value_t v = devs_value_from_gc_obj(ctx, pkt);
+        devs_value_pin(ctx, v);
+        devs_buffer_t *buf = devs_buffer_try_alloc_init(ctx, pkt->inline_payload, pkt->inline_size);
+        devs_value_unpin(ctx, v);
+        pkt->payload = buf;
+    }
+    return pkt->payload;
+}
+
 value_t prop_DsPacket_payload(devs_ctx_t *ctx, value_t self) {
     SELF();
-    return devs_value_from_gc_obj(ctx, pkt->payload);
+    devs_buffer_t *buf = devs_packet_payload(ctx, pkt);
+    return buf ? devs_value_from_gc_obj(ctx, buf) : devs_undefined;
 }
 
 static bool is_event(devs_packet_t *pkt) {
@@ -167,8 +179,11 @@ value_t prop_DsPacket_spec(devs_ctx_t *ctx, value_t self) {
 void meth0_DsPacket_decode(devs_ctx_t *ctx) {
     devs_packet_t *pkt = devs_value_to_packet_or_throw(ctx, devs_arg_self(ctx));
     const devs_packet_spec_t *pspec = devs_pkt_get_spec(ctx, pkt);
-    if (pspec)
-        devs_ret(ctx, devs_packet_decode(ctx, pspec, pkt->payload->data, pkt->payload->length));
+    if (pspec) {
+        unsigned sz;
+        uint8_t *data = devs_packet_data(pkt, &sz);
+        devs_ret(ctx, devs_packet_decode(ctx, pspec, data, sz));
+    }
 }
 
 void meth0_DsPacket_notImplemented(devs_ctx_t *ctx) {
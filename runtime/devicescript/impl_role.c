@@ -45,3 +45,26 @@ void meth2_DsRole_sendCommand(devs_ctx_t *ctx) {
         devs_jd_send_cmd(ctx, role, cmd);
     }
 }
+
+// packets per second after a burst of `burst` packets; 0 leaves only the global limit
+void meth2_DsRole_setSendRate(devs_ctx_t *ctx) {
+    unsigned role = devs_arg_self_role(ctx);
+    if (role == DEVS_ROLE_INVALID)
+        return;
+
+    double rate = devs_arg_double(ctx, 0);
+    int burst = devs_is_undefined(devs_arg(ctx, 1)) ? ctx->role_send_burst : devs_arg_int(ctx, 1);
+    if (!(rate >= 0) || burst < 1 || burst > 0xff) {
+        devs_throw_range_error(ctx, "invalid send rate");
+        return;
+    }
+
+    devs_role_t *r = devs_role(ctx, role);
+    if (rate == 0) {
+        r->send_cost_ms = 0;
+    } else {
+        double cost = 1000 / rate;
+        r->send_cost_ms = cost < 1 ? 1 : cost > 0xffff ? 0xffff : (unsigned)cost;
+    }
+    r->send_burst = burst;
+}
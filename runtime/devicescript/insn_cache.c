@@ -0,0 +1,93 @@
+#include "devs_internal.h"
+#include "devs_vm_internal.h"
+
+#if DEVS_INSN_CACHE_SIZE
+
+static bool decode_int(const uint8_t *code, unsigned len, unsigned *pcp, int32_t *res) {
+    unsigned pc = *pcp;
+    uint8_t v = code[pc++];
+    if (v < DEVS_FIRST_MULTIBYTE_INT) {
+        *pcp = pc;
+        *res = v;
+        return true;
+    }
+
+    int32_t r = 0;
+    bool n = !!(v & 4);
+    unsigned sz = (v & 3) + 1;
+    if (pc + sz > len)
+        return false;
+    for (unsigned i = 0; i < sz; ++i) {
+        r <<= 8;
+        r |= code[pc++];
+    }
+
+    *pcp = pc;
+    *res = n ? -r : r;
+    return true;
+}
+
+static devs_vm_insn_t *decode_function(devs_ctx_t *ctx, const devs_function_desc_t *func) {
+    unsigned len = func->length;
+    // one entry per byte, plus a zero one at maxpc, so the VM can index by pc without checks
+    unsigned sz = (len + 1) * sizeof(devs_vm_insn_t);
+    if (ctx->insn_cache_size + sz > DEVS_INSN_CACHE_SIZE)
+        return NULL;
+
+    devs_vm_insn_t *res = jd_alloc(sz);
+    ctx->insn_cache_size += sz;
+
+    const uint8_t *code = ctx->img.data + func->start;
+    unsigned pc = 0;
+    while (pc < len) {
+        unsigned start = pc;
+        uint8_t op = code[pc++];
+        int32_t arg = 0;
+        if (op < DEVS_DIRECT_CONST_OP) {
+            // leave it for the bytecode path to report
+            if (op == 0 || op >= DEVS_OP_PAST_LAST)
+                continue;
+            if ((DEVS_OP_PROPS[op] & DEVS_BYTECODEFLAG_TAKES_NUMBER) &&
+                (pc >= len || !decode_int(code, len, &pc, &arg)))
+                break;
+        }
+        res[start].op = op;
+        res[start].size = pc - start;
+        res[start].arg = arg;
+    }
+
+    return res;
+}
+
+const devs_vm_insn_t *devs_vm_get_insns(devs_ctx_t *ctx, const devs_function_desc_t *func) {
+    if (ctx->dbg_en)
+        return NULL;
+
+    unsigned num_fn = devs_img_num_functions(ctx->img);
+    if (!ctx->insn_cache) {
+        unsigned sz = num_fn * sizeof(devs_vm_insn_t *);
+        if (sz > DEVS_INSN_CACHE_SIZE)
+            return NULL;
+        ctx->insn_cache = jd_alloc(sz);
+        ctx->insn_cache_size = sz;
+    }
+
+    unsigned fidx = func - devs_img_get_function(ctx->img, 0);
+    JD_ASSERT(fidx < num_fn);
+    if (!ctx->insn_cache[fidx])
+        ctx->insn_cache[fidx] = decode_function(ctx, func);
+    return ctx->insn_cache[fidx];
+}
+
+void devs_vm_free_insns(devs_ctx_t *ctx) {
+    if (!ctx->insn_cache)
+        return;
+    unsigned num_fn = devs_img_num_functions(ctx->img);
+    for (unsigned i = 0; i < num_fn; ++i)
+        jd_free(ctx->insn_cache[i]);
+    jd_free(ctx->insn_cache);
+    ctx->insn_cache = NULL;
+    ctx->insn_cache_size = 0;
+}
+
+#endif
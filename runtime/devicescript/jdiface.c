@@ -7,6 +7,20 @@
 #define RESUME_USER_CODE 1
 #define KEEP_WAITING 0
 
+// how often a fiber waiting on another fiber's register read checks that one is still there
+#define REG_GET_FOLLOWER_TIMEOUT 1000
+
+// the fiber sending requests for the same register as fib, if any
+static devs_fiber_t *reg_get_leader(devs_ctx_t *ctx, devs_fiber_t *fib) {
+    for (devs_fiber_t *f = ctx->fibers; f; f = f->next) {
+        if (f != fib && f->pkt_kind == DEVS_PKT_KIND_REG_GET && !f->reg_get_follower &&
+            f->role_idx == fib->role_idx && f->service_command == fib->service_command &&
+            f->pkt_data.reg_get.string_idx == fib->pkt_data.reg_get.string_idx)
+            return f;
+    }
+    return NULL;
+}
+
 static void devs_jd_setup_cached(devs_ctx_t *ctx, unsigned role_idx,
                                  devs_regcache_entry_t *cached) {
     jd_device_service_t *serv = devs_role_service(ctx, role_idx);
@@ -35,10 +49,12 @@ void devs_jd_get_register(devs_ctx_t *ctx, unsigned role_idx, unsigned code, uns
             if (cached->last_refresh_time + timeout < devs_now(ctx)) {
                 devs_regcache_free(&ctx->regcache, cached);
             } else {
+                ctx->regcache.stats.hits++;
                 devs_jd_setup_cached(ctx, role_idx, cached);
                 return;
             }
         }
+        ctx->regcache.stats.misses++;
     }
 
     devs_fiber_t *fib = ctx->curr_fiber;
@@ -49,6 +65,13 @@ void devs_jd_get_register(devs_ctx_t *ctx, unsigned role_idx, unsigned code, uns
     fib->pkt_data.reg_get.string_idx = arg;
     fib->pkt_data.reg_get.resend_timeout = 20;
 
+    fib->reg_get_follower = reg_get_leader(ctx, fib) != NULL;
+    if (fib->reg_get_follower) {
+        // don't send another request; devs_jd_update_all_regcache() wakes all readers
+        devs_fiber_sleep(fib, REG_GET_FOLLOWER_TIMEOUT);
+        return;
+    }
+
     // DMESG("wait reg %x", code);
     devs_fiber_sleep(fib, 0);
 }
@@ -64,25 +87,101 @@ void devs_jd_clear_pkt_kind(devs_fiber_t *fib) {
     }
     fib->pkt_data.v = devs_undefined;
     fib->pkt_kind = DEVS_PKT_KIND_NONE;
+    fib->reg_get_follower = 0;
+    fib->throttled = 0;
 }
 
-#define THROTTLE_BURST_PKTS 5
-#define THROTTLE_COST_MS 20
+static unsigned dcfg_clamp(const char *key, unsigned def, unsigned min, unsigned max) {
+    int v = dcfg_get_i32(key, def);
+    return v < 0 ? def : (unsigned)v < min ? min : (unsigned)v > max ? max : (unsigned)v;
+}
 
-static void throttle_send_pkt(devs_ctx_t *ctx, devs_fiber_t *fib, int minsleep) {
-    uint32_t n = devs_now(ctx);
-    uint32_t past = n - THROTTLE_BURST_PKTS * THROTTLE_COST_MS;
-    if (past > n)
+void devs_jd_init_throttle(devs_ctx_t *ctx) {
+    // with a burst of 0 the bucket never has a token
+    ctx->send_burst = dcfg_clamp("sendBurst", DEVS_THROTTLE_BURST, 1, 0xff);
+    ctx->send_cost_ms = dcfg_clamp("sendCost", DEVS_THROTTLE_COST_MS, 0, 0xffff);
+    ctx->role_send_burst = dcfg_clamp("roleSendBurst", DEVS_THROTTLE_ROLE_BURST, 1, 0xff);
+    ctx->role_send_cost_ms = dcfg_clamp("roleSendCost", DEVS_THROTTLE_ROLE_COST_MS, 0, 0xffff);
+}
+
+// Token bucket kept as the time at which it will be full again (minus burst * cost).
+static uint32_t throttle_base(uint32_t full_time, uint32_t now, unsigned burst, unsigned cost) {
+    uint32_t past = now - burst * cost;
+    if (past > now)
         past = 0; // underflow
-    if (ctx->send_pkt_throttle < past)
-        ctx->send_pkt_throttle = past;
-    ctx->send_pkt_throttle += THROTTLE_COST_MS;
-    int sleep = ctx->send_pkt_throttle - n;
-    if (sleep < minsleep)
-        sleep = minsleep;
-    else
-        ctx->num_throttled_pkts++;
+    return full_time < past ? past : full_time;
+}
+
+// how long until a token is available (<= 0 if there is one now); doesn't take it
+static int throttle_wait(uint32_t full_time, uint32_t now, unsigned burst, unsigned cost) {
+    return throttle_base(full_time, now, burst, cost) + cost - now;
+}
+
+static void throttle_take(uint32_t *full_time, uint32_t now, unsigned burst, unsigned cost) {
+    *full_time = throttle_base(*full_time, now, burst, cost) + cost;
+}
+
+// Returns true if the fiber's packet can go out now. Otherwise puts the fiber to sleep until
+// both the global and the role bucket have a token. Neither bucket is drained here, so a packet
+// held back by its role doesn't use up the global budget of other roles; see throttle_sent().
+static bool throttle_send_pkt(devs_fiber_t *fib) {
+    devs_ctx_t *ctx = fib->ctx;
+    uint32_t n = devs_now(ctx);
+    int sleep = throttle_wait(ctx->send_pkt_throttle, n, ctx->send_burst, ctx->send_cost_ms);
+    bool global = sleep > 0;
+
+    devs_role_t *r = devs_role(ctx, fib->role_idx);
+    if (r && r->send_cost_ms) {
+        int rsleep = throttle_wait(r->send_throttle, n, r->send_burst, r->send_cost_ms);
+        if (rsleep > sleep)
+            sleep = rsleep;
+    }
+
+    if (sleep <= 0)
+        return true;
+
+    if (r)
+        r->send_stats.throttled_ms += sleep;
+    if (!fib->throttled) {
+        // count each packet once, even if it loses the token to another fiber on wake up
+        fib->throttled = 1;
+        if (r)
+            r->send_stats.throttled++;
+        if (global)
+            ctx->num_throttled_pkts++;
+    }
     devs_fiber_sleep(fib, sleep);
+    return false;
+}
+
+// takes the tokens once the packet was queued
+static void throttle_sent(devs_fiber_t *fib) {
+    devs_ctx_t *ctx = fib->ctx;
+    uint32_t n = devs_now(ctx);
+    throttle_take(&ctx->send_pkt_throttle, n, ctx->send_burst, ctx->send_cost_ms);
+    devs_role_t *r = devs_role(ctx, fib->role_idx);
+    if (r) {
+        r->send_stats.sent++;
+        if (r->send_cost_ms)
+            throttle_take(&r->send_throttle, n, r->send_burst, r->send_cost_ms);
+    }
+    fib->throttled = 0;
+}
+
+void devs_jd_print_throttled(devs_ctx_t *ctx) {
+    if (ctx->num_throttled_pkts) {
+        DMESG("%u packets throttled", (unsigned)ctx->num_throttled_pkts);
+        ctx->num_throttled_pkts = 0;
+    }
+    for (unsigned idx = 0; idx < ctx->num_roles; ++idx) {
+        devs_role_t *r = devs_role(ctx, idx);
+        if (r && r->send_stats.throttled != r->reported_throttled) {
+            DMESG("%s: %u packets throttled, %u ms total", devs_role_name(ctx, idx),
+                  (unsigned)(r->send_stats.throttled - r->reported_throttled),
+                  (unsigned)r->send_stats.throttled_ms);
+            r->reported_throttled = r->send_stats.throttled;
+        }
+    }
 }
 
 void devs_jd_send_cmd(devs_ctx_t *ctx, unsigned role_idx, unsigned code) {
@@ -108,7 +207,8 @@ void devs_jd_send_cmd(devs_ctx_t *ctx, unsigned role_idx, unsigned code) {
         fib->pkt_data.send_pkt.size = sz;
         memcpy(fib->pkt_data.send_pkt.data, ctx->packet.data, sz);
     }
-    throttle_send_pkt(ctx, fib, 0);
+    // the packet goes out from devs_jd_should_run(), once the throttle allows
+    devs_fiber_sleep(fib, 0);
 }
 
 void devs_jd_send_raw(devs_ctx_t *ctx) {
@@ -130,7 +230,8 @@ void devs_jd_send_raw(devs_ctx_t *ctx) {
         fib->pkt_data.send_pkt.size = sz;
         memcpy(fib->pkt_data.send_pkt.data, pkt, sz);
     }
-    throttle_send_pkt(ctx, fib, 0);
+    // the packet goes out from devs_jd_should_run(), once the throttle allows
+    devs_fiber_sleep(fib, 0);
 }
 
 void devs_jd_send_logmsg(devs_ctx_t *ctx, char lev, value_t str) {
@@ -180,18 +281,13 @@ static void devs_jd_set_packet(devs_ctx_t *ctx, unsigned role_idx, unsigned serv
 value_t devs_jd_pkt_capture(devs_ctx_t *ctx, unsigned role_idx) {
     if (ctx->packet.service_index == 0xff)
         return devs_undefined;
-    devs_packet_t *pkt = devs_any_try_alloc(ctx, DEVS_GC_TAG_PACKET, sizeof(*pkt));
+    unsigned sz = ctx->packet.service_size;
+    devs_packet_t *pkt = devs_any_try_alloc(ctx, DEVS_GC_TAG_PACKET, sizeof(*pkt) + sz);
     if (pkt == NULL)
         return devs_undefined;
 
-    value_t r = devs_value_from_gc_obj(ctx, pkt);
-    devs_value_pin(ctx, r);
-
-    pkt->payload = devs_buffer_try_alloc_init(ctx, ctx->packet.data, ctx->packet.service_size);
-    if (pkt->payload == NULL) {
-        devs_value_unpin(ctx, r);
-        return devs_undefined;
-    }
+    pkt->inline_size = sz;
+    memcpy(pkt->inline_payload, ctx->packet.data, sz);
     pkt->device_id = ctx->packet.device_identifier;
     pkt->service_index = ctx->packet.service_index;
     pkt->service_command = ctx->packet.service_command;
@@ -199,8 +295,7 @@ value_t devs_jd_pkt_capture(devs_ctx_t *ctx, unsigned role_idx) {
     pkt->roleidx = role_idx;
     pkt->crc = ctx->packet.crc;
 
-    devs_value_unpin(ctx, r);
-    return r;
+    return devs_value_from_gc_obj(ctx, pkt);
 }
 
 static void start_pkt_handler(devs_ctx_t *ctx, value_t fn, unsigned role_idx) {
@@ -217,7 +312,9 @@ static void start_pkt_handler(devs_ctx_t *ctx, value_t fn, unsigned role_idx) {
     // null it out first, in case devs_jd_pkt_capture() triggers GC
     ctx->the_stack[1] = devs_undefined;
     ctx->the_stack[1] = devs_jd_pkt_capture(ctx, role_idx);
-    devs_fiber_start(ctx, 1, DEVS_OPCALL_BG);
+    devs_fiber_t *fiber = devs_fiber_start(ctx, 1, DEVS_OPCALL_BG);
+    if (fiber)
+        devs_fiber_set_priority(fiber, DEVS_FIBER_PRIO_HIGH);
 }
 
 void devs_jd_wake_role(devs_ctx_t *ctx, unsigned role_idx, bool is_role_evt) {
@@ -294,8 +391,142 @@ static bool devs_jd_pkt_matches_role(devs_ctx_t *ctx, unsigned role_idx) {
            jd_service_parent(serv)->device_identifier == pkt->device_identifier;
 }
 
+static unsigned dispatch_bucket(devs_ctx_t *ctx, uint64_t device_identifier,
+                                unsigned service_index) {
+    uint32_t h = (uint32_t)device_identifier ^ (uint32_t)(device_identifier >> 32);
+    h = (h ^ service_index) * 0x9e3779b1;
+    return (h >> 16) % ctx->role_dispatch_size;
+}
+
+static void unindex_role(devs_ctx_t *ctx, unsigned role_idx) {
+    devs_role_t *r = devs_role(ctx, role_idx);
+    if (!r || !r->dispatch_bound || !ctx->role_dispatch)
+        return;
+    r->dispatch_bound = 0;
+    uint16_t *p =
+        &ctx->role_dispatch[dispatch_bucket(ctx, r->dispatch_device, r->dispatch_service_index)];
+    while (*p) {
+        if (*p == role_idx + 1) {
+            *p = r->dispatch_next;
+            break;
+        }
+        p = &ctx->roles[*p - 1]->dispatch_next;
+    }
+    r->dispatch_next = 0;
+}
+
+// keep the bucket sorted, so roles are woken in the same order as with a linear scan
+static void index_role(devs_ctx_t *ctx, unsigned role_idx) {
+    devs_role_t *r = devs_role(ctx, role_idx);
+    jd_device_service_t *serv = devs_role_service(ctx, role_idx);
+    if (!serv || !ctx->role_dispatch)
+        return;
+    r->dispatch_device = jd_service_parent(serv)->device_identifier;
+    r->dispatch_service_index = serv->service_index;
+    r->dispatch_bound = 1;
+    uint16_t *p =
+        &ctx->role_dispatch[dispatch_bucket(ctx, r->dispatch_device, r->dispatch_service_index)];
+    while (*p && *p < role_idx + 1)
+        p = &ctx->roles[*p - 1]->dispatch_next;
+    r->dispatch_next = *p;
+    *p = role_idx + 1;
+}
+
+// called when ctx->roles grows, to keep one bucket per role
+static bool rebuild_role_dispatch(devs_ctx_t *ctx) {
+    devs_free(ctx, ctx->role_dispatch);
+    ctx->role_dispatch = devs_try_alloc(ctx, ctx->num_roles * sizeof(uint16_t));
+    if (!ctx->role_dispatch) {
+        ctx->role_dispatch_size = 0;
+        return false;
+    }
+    ctx->role_dispatch_size = ctx->num_roles;
+    for (unsigned idx = 0; idx < ctx->num_roles; ++idx) {
+        devs_role_t *r = devs_role(ctx, idx);
+        if (r) {
+            r->dispatch_bound = 0;
+            r->dispatch_next = 0;
+            index_role(ctx, idx);
+        }
+    }
+    return true;
+}
+
+#if DEVS_TX_BATCH_FRAMES
+#define FRAME_HEADER_SIZE offsetof(jd_frame_t, data)
+#define FRAME_DATA_SIZE (JD_SERIAL_PAYLOAD_SIZE + 4)
+
+static int send_oldest_frame(devs_tx_batch_t *b) {
+    jd_frame_t *f = &b->frames[0];
+    // jd_packet_t is a view of the first packet of a frame, and jd_send_pkt() queues the whole
+    // frame (JD_FRAME_SIZE()); the tx queue and transports deal in frames (see posix/tx.c), and
+    // the loopback splits them into packets again; the server package tests check that every
+    // packet from a batch arrives
+    if (jd_send_pkt((jd_packet_t *)f) != 0)
+        return -1;
+    b->num_frames--;
+    memmove(f, f + 1, b->num_frames * sizeof(jd_frame_t));
+    return 0;
+}
+#endif
+
+// Like jd_send_pkt(), but the packet may be held until devs_jd_flush_tx() in a frame with other
+// packets for the same device. All packets from fibers go through here, so that a register
+// read doesn't overtake a command to the same device.
+static int queue_pkt(devs_ctx_t *ctx, jd_packet_t *pkt) {
+#if DEVS_TX_BATCH_FRAMES
+    // acks refer to the crc of the frame, so these go on their own (after anything queued)
+    if (pkt->flags & JD_FRAME_FLAG_ACK_REQUESTED) {
+        if (devs_jd_flush_tx(ctx))
+            return -1;
+        return jd_send_pkt(pkt);
+    }
+
+    devs_tx_batch_t *b = ctx->tx_batch;
+    if (!b)
+        b = ctx->tx_batch = jd_alloc(sizeof(devs_tx_batch_t));
+
+    unsigned sz = (pkt->service_size + 4 + 3) & ~3;
+    jd_frame_t *f = NULL;
+    for (unsigned i = 0; i < b->num_frames; ++i) {
+        jd_frame_t *fr = &b->frames[i];
+        if (fr->device_identifier == pkt->device_identifier && fr->flags == pkt->flags) {
+            // the last one for the device; keep packets in order
+            f = fr->size + sz <= FRAME_DATA_SIZE ? fr : NULL;
+        }
+    }
+
+    if (!f) {
+        if (b->num_frames == DEVS_TX_BATCH_FRAMES && send_oldest_frame(b) != 0)
+            return -1;
+        f = &b->frames[b->num_frames++];
+        memcpy(f, pkt, FRAME_HEADER_SIZE);
+        f->size = 0;
+    }
+
+    memcpy(f->data + f->size, &pkt->service_size, pkt->service_size + 4);
+    f->size += sz;
+    return 0;
+#else
+    return jd_send_pkt(pkt);
+#endif
+}
+
+bool devs_jd_flush_tx(devs_ctx_t *ctx) {
+#if DEVS_TX_BATCH_FRAMES
+    devs_tx_batch_t *b = ctx->tx_batch;
+    if (!b)
+        return false;
+    while (b->num_frames) {
+        if (send_oldest_frame(b) != 0)
+            return true;
+    }
+#endif
+    return false;
+}
+
 static bool retry_soon(devs_fiber_t *fiber) {
-    throttle_send_pkt(fiber->ctx, fiber, 3);
+    devs_fiber_sleep(fiber, 3);
     return KEEP_WAITING;
 }
 
@@ -332,6 +563,15 @@ static bool handle_reg_get(devs_fiber_t *fiber) {
     }
 
     if (devs_now(ctx) >= fiber->wake_time) {
+        if (fiber->reg_get_follower) {
+            if (reg_get_leader(ctx, fiber)) {
+                devs_fiber_sleep(fiber, REG_GET_FOLLOWER_TIMEOUT);
+                return KEEP_WAITING;
+            }
+            // the fiber that was sending requests is gone; take over
+            fiber->reg_get_follower = 0;
+        }
+
         unsigned arglen = 0;
         const void *argp = NULL;
         if (fiber->pkt_data.reg_get.string_idx) {
@@ -339,7 +579,7 @@ static bool handle_reg_get(devs_fiber_t *fiber) {
         }
 
         devs_jd_set_packet(ctx, fiber->role_idx, fiber->service_command, argp, arglen);
-        if (jd_send_pkt(&ctx->packet) != 0) {
+        if (queue_pkt(ctx, &ctx->packet) != 0) {
             LOGV("(re)send pkt FAILED cmd=%x", fiber->service_command);
             return retry_soon(fiber);
         } else {
@@ -357,10 +597,14 @@ static bool handle_send_pkt(devs_fiber_t *fiber) {
     if (role_missing(fiber))
         return KEEP_WAITING;
 
+    if (!throttle_send_pkt(fiber))
+        return KEEP_WAITING;
+
     devs_ctx_t *ctx = fiber->ctx;
     devs_jd_set_packet(ctx, fiber->role_idx, fiber->service_command, fiber->pkt_data.send_pkt.data,
                        fiber->pkt_data.send_pkt.size);
-    if (jd_send_pkt(&ctx->packet) == 0) {
+    if (queue_pkt(ctx, &ctx->packet) == 0) {
+        throttle_sent(fiber);
         LOGV("send pkt cmd=%x sz=%d", fiber->service_command, ctx->packet.service_size);
         // jd_log_packet(&ctx->packet);
         return RESUME_USER_CODE;
@@ -371,8 +615,12 @@ static bool handle_send_pkt(devs_fiber_t *fiber) {
 }
 
 static bool handle_send_raw_pkt(devs_fiber_t *fiber) {
+    if (!throttle_send_pkt(fiber))
+        return KEEP_WAITING;
+
     jd_packet_t *pkt = (void *)fiber->pkt_data.send_pkt.data;
-    if (jd_send_pkt(pkt) == 0) {
+    if (queue_pkt(fiber->ctx, pkt) == 0) {
+        throttle_sent(fiber);
         LOGV("send raw pkt cmd=%x", fiber->service_command);
         // jd_log_packet(pkt);
         return RESUME_USER_CODE;
@@ -427,6 +675,7 @@ static void devs_jd_update_all_regcache(devs_ctx_t *ctx, unsigned role_idx) {
             if (q) {
                 q = devs_regcache_mark_used(&ctx->regcache, q);
                 fiber->role_wkp = 1;
+                devs_fiber_add_ready(fiber);
                 num++;
             }
         }
@@ -445,6 +694,12 @@ static void devs_jd_update_all_regcache(devs_ctx_t *ctx, unsigned role_idx) {
     }
 }
 
+static void wake_matching_role(devs_ctx_t *ctx, unsigned role_idx) {
+    devs_fiber_sync_now(ctx);
+    devs_jd_update_all_regcache(ctx, role_idx);
+    devs_jd_wake_role(ctx, role_idx, false);
+}
+
 void devs_jd_process_pkt(devs_ctx_t *ctx, jd_device_service_t *serv, jd_packet_t *pkt) {
     if (devs_is_suspended(ctx))
         return;
@@ -465,11 +720,23 @@ void devs_jd_process_pkt(devs_ctx_t *ctx, jd_device_service_t *serv, jd_packet_t
 
     // DMESG("pkt %d %x / %d", pkt->service_index, pkt->service_command, pkt->service_size);
 
-    for (unsigned idx = 0; idx < ctx->num_roles; ++idx) {
-        if (devs_jd_pkt_matches_role(ctx, idx)) {
-            devs_fiber_sync_now(ctx);
-            devs_jd_update_all_regcache(ctx, idx);
-            devs_jd_wake_role(ctx, idx, false);
+    if (ctx->role_dispatch && (pkt->service_index != 0 || pkt->service_command != 0)) {
+        unsigned i = ctx->role_dispatch[dispatch_bucket(ctx, pkt->device_identifier,
+                                                        pkt->service_index)];
+        while (i) {
+            unsigned idx = i - 1;
+            devs_role_t *r = ctx->roles[idx];
+            i = r->dispatch_next;
+            if (r->dispatch_device == pkt->device_identifier &&
+                r->dispatch_service_index == pkt->service_index &&
+                devs_jd_pkt_matches_role(ctx, idx))
+                wake_matching_role(ctx, idx);
+        }
+    } else {
+        // announce packets go to all roles bound to the device
+        for (unsigned idx = 0; idx < ctx->num_roles; ++idx) {
+            if (devs_jd_pkt_matches_role(ctx, idx))
+                wake_matching_role(ctx, idx);
         }
     }
 
@@ -497,6 +764,8 @@ void devs_jd_role_changed(devs_ctx_t *ctx, jd_role_t *role) {
     for (unsigned idx = 0; idx < ctx->num_roles; ++idx) {
         devs_role_t *r = devs_role(ctx, idx);
         if (r && r->jdrole == role) {
+            unindex_role(ctx, idx);
+            index_role(ctx, idx);
             devs_regcache_free_role(&ctx->regcache, idx);
             devs_jd_reset_packet(ctx);
             devs_jd_wake_role(ctx, idx, true);
@@ -570,6 +839,16 @@ int devs_jd_alloc_role(devs_ctx_t *ctx, value_t name, uint32_t srv_class) {
         devs_free(ctx, ctx->roles);
         ctx->roles = rr;
         ctx->num_roles = newsz;
+        ctx->role_dispatch_size = 0; // force rebuild below
+    }
+
+    // also retries after a rebuild that failed when the roles array last grew
+    if (ctx->role_dispatch_size != ctx->num_roles) {
+        if (!rebuild_role_dispatch(ctx)) {
+            devs_free(ctx, r);
+            idx = -1;
+            goto exit;
+        }
     }
 
     if (NULL == (r->jdrole = jd_role_alloc(n, srv_class))) {
@@ -577,7 +856,10 @@ int devs_jd_alloc_role(devs_ctx_t *ctx, value_t name, uint32_t srv_class) {
         idx = -1;
     } else {
         r->name = name;
+        r->send_burst = ctx->role_send_burst;
+        r->send_cost_ms = ctx->role_send_cost_ms;
         ctx->roles[idx] = r;
+        index_role(ctx, idx);
         ctx->flags |= DEVS_CTX_PENDING_ROLES;
         LOG("create role '%s' -> %d", n, idx);
     }
@@ -5,6 +5,8 @@
 #include "devs_logging.h"
 
 void devs_map_clear(devs_ctx_t *ctx, devs_map_t *map) {
+    if (map->shape)
+        map->shape = ctx->root_shape;
     if (map->data) {
         devs_free(ctx, map->data);
         map->data = NULL;
@@ -28,33 +30,50 @@ static value_t *lookup_short(devs_ctx_t *ctx, devs_short_map_t *map, uint16_t ke
     return NULL;
 }
 
-static value_t *lookup(devs_ctx_t *ctx, devs_map_t *map, value_t key) {
+static int lookup_idx(devs_ctx_t *ctx, devs_map_t *map, value_t key) {
     if (!devs_is_string(ctx, key))
-        return NULL;
+        return -1;
 
-    value_t *data = map->data;
-    uint32_t kh = devs_handle_value(key);
-    unsigned len2 = map->length * 2;
+    value_t *keys;
+    unsigned stride, len = map->length;
 
-    // do a quick reference-only check
-    for (unsigned i = 0; i < len2; i += 2) {
-        // check the low bits first, since they are more likely to be different
-        if (devs_handle_value(data[i]) == kh && data[i].u64 == key.u64) {
-            return &data[i + 1];
+    if (map->shape) {
+        int r = devs_shape_find(map->shape, key);
+        if (r >= 0)
+            return r;
+        keys = map->shape->keys;
+        stride = 1;
+    } else {
+        keys = map->data;
+        stride = 2;
+
+        // do a quick reference-only check
+        uint32_t kh = devs_handle_value(key);
+        for (unsigned i = 0; i < len; i++) {
+            // check the low bits first, since they are more likely to be different
+            if (devs_handle_value(keys[i * 2]) == kh && keys[i * 2].u64 == key.u64)
+                return i;
         }
     }
 
     // slow path - compare strings
     unsigned ksz, csz;
     const char *cp, *kp = devs_string_get_utf8(ctx, key, &ksz);
-    for (unsigned i = 0; i < len2; i += 2) {
-        cp = devs_string_get_utf8(ctx, data[i], &csz);
+    for (unsigned i = 0; i < len; i++) {
+        cp = devs_string_get_utf8(ctx, keys[i * stride], &csz);
         if (csz == ksz && memcmp(kp, cp, ksz) == 0)
-            return &data[i + 1];
+            return i;
     }
 
     // nothing found...
-    return NULL;
+    return -1;
+}
+
+static value_t *lookup(devs_ctx_t *ctx, devs_map_t *map, value_t key) {
+    int idx = lookup_idx(ctx, map, key);
+    if (idx < 0)
+        return NULL;
+    return devs_map_value_ptr(map, idx);
 }
 
 static value_t proto_value(devs_ctx_t *ctx, const devs_builtin_proto_entry_t *p) {
@@ -86,10 +105,8 @@ unsigned devs_maplike_iter(devs_ctx_t *ctx, devs_maplike_t *src, void *userdata,
         unsigned len = srcmap->length;
 
         if (cb != NULL) {
-            unsigned len2 = srcmap->length * 2;
-            value_t *data = srcmap->data;
-            for (unsigned i = 0; i < len2; i += 2) {
-                cb(ctx, userdata, data[i], data[i + 1]);
+            for (unsigned i = 0; i < len; i++) {
+                cb(ctx, userdata, devs_map_key_at(srcmap, i), *devs_map_value_ptr(srcmap, i));
             }
         }
 
@@ -145,6 +162,55 @@ static int grow_len(int capacity) {
     return newlen;
 }
 
+static int map_to_dictionary(devs_ctx_t *ctx, devs_map_t *map) {
+    unsigned len = map->length;
+    value_t *tmp = NULL;
+
+    if (len) {
+        tmp = devs_try_alloc(ctx, len * (2 * sizeof(value_t)));
+        if (!tmp)
+            return -1;
+        for (unsigned i = 0; i < len; ++i) {
+            tmp[i * 2] = map->shape->keys[i];
+            tmp[i * 2 + 1] = map->data[i];
+        }
+    }
+
+    map->shape = NULL;
+    map->data = tmp;
+    map->capacity = len;
+    jd_gc_unpin(ctx->gc, tmp);
+    return 0;
+}
+
+// returns false when map has to go into dictionary mode
+static bool shaped_map_add(devs_ctx_t *ctx, devs_map_t *map, value_t key, value_t v) {
+    JD_ASSERT(map->capacity >= map->length);
+
+    // grow first - a new shape can be collected until it's stored in the map
+    if (map->capacity == map->length) {
+        int newlen = grow_len(map->capacity);
+        value_t *tmp = devs_try_alloc(ctx, newlen * sizeof(value_t));
+        if (!tmp)
+            return false;
+        map->capacity = newlen;
+        if (map->length) {
+            memcpy(tmp, map->data, map->length * sizeof(value_t));
+        }
+        map->data = tmp;
+        jd_gc_unpin(ctx->gc, tmp);
+    }
+
+    devs_map_shape_t *sh = devs_shape_transition(ctx, map->shape, key);
+    if (sh == NULL)
+        return false;
+
+    map->shape = sh;
+    map->data[map->length] = v;
+    map->length++;
+    return true;
+}
+
 void devs_map_set(devs_ctx_t *ctx, devs_map_t *map, value_t key, value_t v) {
     value_t *tmp = lookup(ctx, map, key);
     if (tmp != NULL) {
@@ -157,6 +223,13 @@ void devs_map_set(devs_ctx_t *ctx, devs_map_t *map, value_t key, value_t v) {
         return;
     }
 
+    if (map->shape) {
+        if (shaped_map_add(ctx, map, key, v))
+            return;
+        if (map_to_dictionary(ctx, map))
+            return;
+    }
+
     JD_ASSERT(map->capacity >= map->length);
 
     if (map->capacity == map->length) {
@@ -207,14 +280,16 @@ void devs_short_map_set(devs_ctx_t *ctx, devs_short_map_t *map, uint16_t key, va
 }
 
 int devs_map_delete(devs_ctx_t *ctx, devs_map_t *map, value_t key) {
-    value_t *tmp = lookup(ctx, map, key);
-    if (tmp == NULL) {
+    int idx = lookup_idx(ctx, map, key);
+    if (idx < 0) {
         return -1;
     }
 
-    tmp--;
-    unsigned off = tmp - map->data;
-    unsigned trailing = map->length - off / 2 - 1;
+    if (map->shape && map_to_dictionary(ctx, map))
+        return -1;
+
+    value_t *tmp = &map->data[idx * 2];
+    unsigned trailing = map->length - idx - 1;
     map->length--;
     if (trailing)
         memmove(tmp, tmp + 2, trailing * 2 * sizeof(value_t));
@@ -574,6 +649,8 @@ value_t devs_function_bind(devs_ctx_t *ctx, value_t obj, value_t fn) {
 
 value_t devs_make_closure(devs_ctx_t *ctx, devs_activation_t *closure, unsigned fnidx) {
     JD_ASSERT(fnidx <= 0xffff);
+    // captured frames have to outlive the call
+    closure = devs_fiber_promote_frame(ctx, closure);
     return devs_value_from_pointer(ctx, DEVS_HANDLE_TYPE_CLOSURE | (fnidx << 4), closure);
 }
 
@@ -973,6 +1050,47 @@ value_t devs_object_get(devs_ctx_t *ctx, value_t obj, value_t key) {
     return devs_function_bind(ctx, obj, tmp);
 }
 
+#if DEVS_FIELD_IC_SIZE
+value_t devs_object_get_cached(devs_ctx_t *ctx, value_t obj, value_t key, unsigned pc) {
+    ctx->diag_field = key;
+    devs_maplike_t *proto = devs_object_get_attached_ro(ctx, obj);
+    if (proto == NULL || !devs_is_map(proto))
+        return devs_function_bind(ctx, obj, devs_maplike_get_no_bind(ctx, proto, key));
+
+    devs_map_t *map = (devs_map_t *)proto;
+    devs_field_ic_t *ic = &ctx->field_ic[pc & (DEVS_FIELD_IC_SIZE - 1)];
+
+    // objects constructed the same way keep the same key order; a hit is validated by the key
+    // handle itself, so a stale or colliding entry can only cause a miss
+    if (ic->pc == pc) {
+        for (unsigned i = 0; i < DEVS_FIELD_IC_WAYS; ++i) {
+            unsigned idx = ic->slots[i];
+            if (idx < map->length && devs_map_key_at(map, idx).u64 == key.u64)
+                return devs_function_bind(ctx, obj, *devs_map_value_ptr(map, idx));
+        }
+    }
+
+    int idx = lookup_idx(ctx, map, key);
+    if (idx < 0)
+        return devs_function_bind(ctx, obj, devs_maplike_get_no_bind(ctx, map->proto, key));
+
+    if (ic->pc != pc) {
+        ic->pc = pc;
+        for (unsigned i = 1; i < DEVS_FIELD_IC_WAYS; ++i)
+            ic->slots[i] = 0xffff;
+    } else {
+        memmove(ic->slots + 1, ic->slots, (DEVS_FIELD_IC_WAYS - 1) * sizeof(ic->slots[0]));
+    }
+    ic->slots[0] = idx;
+
+    return devs_function_bind(ctx, obj, *devs_map_value_ptr(map, idx));
+}
+#else
+value_t devs_object_get_cached(devs_ctx_t *ctx, value_t obj, value_t key, unsigned pc) {
+    return devs_object_get(ctx, obj, key);
+}
+#endif
+
 value_t devs_object_get_built_in_field(devs_ctx_t *ctx, value_t obj, unsigned idx) {
     value_t key = devs_builtin_string(idx);
     ctx->diag_field = key;
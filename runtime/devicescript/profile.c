@@ -0,0 +1,149 @@
+#include "devs_internal.h"
+
+#if DEVS_PROFILE_SIZE
+
+STATIC_ASSERT((DEVS_PROFILE_SIZE & (DEVS_PROFILE_SIZE - 1)) == 0);
+
+// stop adding new entries when the table is this full, to keep the probe sequences short
+#define MAX_ENTRIES (DEVS_PROFILE_SIZE * 3 / 4)
+
+void devs_profile_start(devs_ctx_t *ctx) {
+    if (!ctx->profile)
+        ctx->profile = jd_alloc(sizeof(devs_profile_t));
+    else
+        memset(ctx->profile, 0, sizeof(devs_profile_t));
+    ctx->profile->countdown = DEVS_PROFILE_INTERVAL;
+    ctx->profile->running = 1;
+}
+
+void devs_profile_stop(devs_ctx_t *ctx) {
+    // keep the samples around, so they can still be read
+    if (ctx->profile)
+        ctx->profile->running = 0;
+}
+
+void devs_profile_free(devs_ctx_t *ctx) {
+    jd_free(ctx->profile);
+    ctx->profile = NULL;
+}
+
+static uint32_t entry_hash(const devs_profile_entry_t *e) {
+    uint32_t h = 0x811c9dc5 ^ e->pc;
+    for (unsigned i = 0; i < e->depth; ++i)
+        h = (h ^ e->fn[i]) * 0x01000193;
+    return h ^ (h >> 16);
+}
+
+static bool entry_eq(const devs_profile_entry_t *a, const devs_profile_entry_t *b) {
+    return a->pc == b->pc && a->depth == b->depth && a->truncated == b->truncated &&
+           memcmp(a->fn, b->fn, a->depth * sizeof(a->fn[0])) == 0;
+}
+
+void devs_profile_sample(devs_ctx_t *ctx) {
+    devs_profile_t *prof = ctx->profile;
+    devs_activation_t *act = ctx->curr_fn;
+    if (!prof || !prof->running || !act)
+        return;
+
+    devs_profile_entry_t key;
+    memset(&key, 0, sizeof(key));
+    key.pc = act->pc;
+
+    const devs_function_desc_t *func0 = devs_img_get_function(ctx->img, 0);
+    unsigned depth = 0;
+    while (act && depth < DEVS_PROFILE_DEPTH) {
+        key.fn[depth++] = act->func - func0;
+        act = act->caller;
+    }
+    key.depth = depth;
+    key.truncated = act != NULL;
+
+    prof->num_samples++;
+
+    uint32_t h = entry_hash(&key);
+    for (unsigned i = 0; i < DEVS_PROFILE_SIZE; ++i) {
+        devs_profile_entry_t *e = &prof->entries[(h + i) & (DEVS_PROFILE_SIZE - 1)];
+        if (e->count == 0) {
+            if (prof->num_entries >= MAX_ENTRIES)
+                break;
+            *e = key;
+            prof->num_entries++;
+        } else if (!entry_eq(e, &key)) {
+            continue;
+        }
+        e->count++;
+        return;
+    }
+
+    prof->num_dropped++;
+}
+
+void devs_profile_write_collapsed(devs_ctx_t *ctx, devs_profile_line_cb_t cb, void *userdata) {
+    devs_profile_t *prof = ctx->profile;
+    if (!prof)
+        return;
+
+    char line[256];
+    for (unsigned i = 0; i < DEVS_PROFILE_SIZE; ++i) {
+        devs_profile_entry_t *e = &prof->entries[i];
+        if (e->count == 0)
+            continue;
+        unsigned len = 0;
+        line[0] = 0;
+        if (e->truncated) {
+            strcpy(line, "...;");
+            len = strlen(line);
+        }
+        // outermost frame first; the innermost one gets the pc
+        for (int j = e->depth - 1; j >= 0; --j) {
+            const char *name = devs_img_fun_name(ctx->img, e->fn[j]);
+            if (j == 0) {
+                const devs_function_desc_t *func = devs_img_get_function(ctx->img, e->fn[0]);
+                jd_sprintf(line + len, sizeof(line) - len, "%s_F%d:%d %u", name, e->fn[0],
+                           (int)(e->pc - func->start), (unsigned)e->count);
+            } else {
+                jd_sprintf(line + len, sizeof(line) - len, "%s_F%d;", name, e->fn[j]);
+            }
+            len = strlen(line);
+        }
+        cb(userdata, line);
+    }
+}
+
+void devs_profile_dump(devs_ctx_t *ctx) {
+    devs_profile_t *prof = ctx->profile;
+    if (!prof || !prof->num_samples)
+        return;
+
+    // per-function histogram of self samples
+    unsigned num_fn = devs_img_num_functions(ctx->img);
+    uint32_t *self = jd_alloc(num_fn * sizeof(uint32_t));
+    for (unsigned i = 0; i < DEVS_PROFILE_SIZE; ++i) {
+        devs_profile_entry_t *e = &prof->entries[i];
+        if (e->count && e->fn[0] < num_fn)
+            self[e->fn[0]] += e->count;
+    }
+
+    DMESG("profile: %u samples every %u steps, %u dropped", (unsigned)prof->num_samples,
+          DEVS_PROFILE_INTERVAL, (unsigned)prof->num_dropped);
+    for (unsigned k = 0; k < 10; ++k) {
+        unsigned best = 0;
+        for (unsigned i = 1; i < num_fn; ++i)
+            if (self[i] > self[best])
+                best = i;
+        if (!self[best])
+            break;
+        DMESG("profile: %3u%% %s_F%d", (unsigned)(self[best] * 100 / prof->num_samples),
+              devs_img_fun_name(ctx->img, best), best);
+        self[best] = 0;
+    }
+    jd_free(self);
+
+    devs_profile_handler(ctx);
+}
+
+#else
+
+void devs_profile_write_collapsed(devs_ctx_t *ctx, devs_profile_line_cb_t cb, void *userdata) {}
+
+#endif
@@ -1,56 +1,116 @@
 #include "devs_internal.h"
 
+// Entries are chained by (role_idx, service_command) in buckets, and kept in a doubly-linked
+// LRU list; all links are entry indices + 1, so entries never move.
+
+#define ENTRY(cache, link) (&(cache)->entries[(link)-1])
+#define LINK(cache, q) ((q) - (cache)->entries + 1)
+
+static unsigned bucket_of(devs_regcache_t *cache, unsigned role_idx, unsigned service_command) {
+    uint32_t h = ((role_idx << 16) | service_command) * 0x9e3779b1;
+    return (h >> 16) & (cache->num_buckets - 1);
+}
+
+static void regcache_init(devs_regcache_t *cache) {
+    unsigned cap = cache->capacity ? cache->capacity : DEVS_REGCACHE_NUM_ENTRIES;
+    unsigned nb = 4;
+    while (nb < cap)
+        nb <<= 1;
+    cache->entries = jd_alloc(cap * sizeof(devs_regcache_entry_t));
+    cache->buckets = jd_alloc(nb * sizeof(uint16_t));
+    cache->capacity = cap;
+    cache->num_buckets = nb;
+    cache->stats.capacity = cap;
+    for (unsigned i = 0; i < cap; ++i)
+        cache->entries[i].lru_next = i + 1 < cap ? i + 2 : 0;
+    cache->free_head = 1;
+}
+
+static void lru_unlink(devs_regcache_t *cache, devs_regcache_entry_t *q) {
+    if (q->lru_prev)
+        ENTRY(cache, q->lru_prev)->lru_next = q->lru_next;
+    else
+        cache->lru_head = q->lru_next;
+    if (q->lru_next)
+        ENTRY(cache, q->lru_next)->lru_prev = q->lru_prev;
+    else
+        cache->lru_tail = q->lru_prev;
+    q->lru_prev = q->lru_next = 0;
+}
+
+static void lru_push(devs_regcache_t *cache, devs_regcache_entry_t *q) {
+    unsigned link = LINK(cache, q);
+    q->lru_prev = 0;
+    q->lru_next = cache->lru_head;
+    if (cache->lru_head)
+        ENTRY(cache, cache->lru_head)->lru_prev = link;
+    else
+        cache->lru_tail = link;
+    cache->lru_head = link;
+}
+
 void devs_regcache_free(devs_regcache_t *cache, devs_regcache_entry_t *q) {
+    if (q->service_command == 0)
+        return;
+
+    uint16_t *p = &cache->buckets[bucket_of(cache, q->role_idx, q->service_command)];
+    unsigned link = LINK(cache, q);
+    while (*p != link)
+        p = &ENTRY(cache, *p)->hash_next;
+    *p = q->hash_next;
+    q->hash_next = 0;
+    lru_unlink(cache, q);
+
     if (q->resp_size > DEVS_QUERY_MAX_INLINE)
         jd_free(q->value.buffer);
     q->resp_size = 0;
     q->service_command = 0;
+
+    q->lru_next = cache->free_head;
+    cache->free_head = link;
+    cache->stats.num_used--;
 }
 
 void devs_regcache_free_all(devs_regcache_t *cache) {
-    for (unsigned i = 0; i < DEVS_REGCACHE_NUM_ENTRIES; ++i) {
-        devs_regcache_free(cache, &cache->entries[i]);
+    if (cache->entries) {
+        for (unsigned i = 0; i < cache->capacity; ++i) {
+            devs_regcache_entry_t *q = &cache->entries[i];
+            if (q->service_command && q->resp_size > DEVS_QUERY_MAX_INLINE)
+                jd_free(q->value.buffer);
+        }
+        jd_free(cache->entries);
+        jd_free(cache->buckets);
     }
+    unsigned cap = cache->capacity;
+    memset(cache, 0, sizeof(*cache));
+    cache->capacity = cap;
 }
 
 devs_regcache_entry_t *devs_regcache_mark_used(devs_regcache_t *cache, devs_regcache_entry_t *q) {
-    unsigned idx = cache->latest_idx;
-    if (q == &cache->entries[idx])
-        return q; // already latest
-    idx++;
-    if (idx >= DEVS_REGCACHE_NUM_ENTRIES)
-        idx = 0;
-    if (q != &cache->entries[idx]) {
-        devs_regcache_entry_t tmp;
-        memcpy(&tmp, q, sizeof(tmp));
-        memcpy(q, &cache->entries[idx], sizeof(tmp));
-        memcpy(&cache->entries[idx], &tmp, sizeof(tmp));
+    if (cache->lru_head != LINK(cache, q)) {
+        lru_unlink(cache, q);
+        lru_push(cache, q);
     }
-    cache->latest_idx = idx;
-    return &cache->entries[idx];
+    return q;
 }
 
 devs_regcache_entry_t *devs_regcache_alloc(devs_regcache_t *cache, unsigned role_idx,
                                            unsigned service_command, unsigned resp_size) {
-    devs_regcache_entry_t *q = NULL;
-
     JD_ASSERT(service_command > 0);
 
-    for (unsigned i = 0; i < DEVS_REGCACHE_NUM_ENTRIES; ++i) {
-        if (cache->entries[i].service_command == 0) {
-            q = &cache->entries[i];
-            break;
-        }
-    }
+    if (!cache->entries)
+        regcache_init(cache);
 
-    if (!q) {
-        unsigned idx = cache->latest_idx + 1;
-        if (idx >= DEVS_REGCACHE_NUM_ENTRIES)
-            idx = 0;
-        q = &cache->entries[idx];
-        devs_regcache_free(cache, q);
+    if (!cache->free_head) {
+        devs_regcache_free(cache, ENTRY(cache, cache->lru_tail));
+        cache->stats.evictions++;
     }
 
+    unsigned link = cache->free_head;
+    devs_regcache_entry_t *q = ENTRY(cache, link);
+    cache->free_head = q->lru_next;
+    cache->stats.num_used++;
+
     q->role_idx = role_idx;
     q->service_command = service_command;
     q->argument = 0;
@@ -58,49 +118,61 @@ devs_regcache_entry_t *devs_regcache_alloc(devs_regcache_t *cache, unsigned role
     if (resp_size > DEVS_QUERY_MAX_INLINE)
         q->value.buffer = jd_alloc(resp_size);
 
-    q = devs_regcache_mark_used(cache, q);
+    uint16_t *b = &cache->buckets[bucket_of(cache, role_idx, service_command)];
+    q->hash_next = *b;
+    *b = link;
+    lru_push(cache, q);
 
     return q;
 }
 
 devs_regcache_entry_t *devs_regcache_lookup(devs_regcache_t *cache, unsigned role_idx,
                                             unsigned service_command, unsigned argument) {
-    for (unsigned i = 0; i < DEVS_REGCACHE_NUM_ENTRIES; ++i) {
-        devs_regcache_entry_t *q = &cache->entries[i];
+    if (!cache->entries || !service_command)
+        return NULL;
+    unsigned link = cache->buckets[bucket_of(cache, role_idx, service_command)];
+    while (link) {
+        devs_regcache_entry_t *q = ENTRY(cache, link);
         if (q->role_idx == role_idx && q->service_command == service_command &&
             q->argument == argument)
             return q;
+        link = q->hash_next;
     }
     return NULL;
 }
 
 void devs_regcache_age(devs_regcache_t *cache, unsigned role_idx, uint32_t min_time) {
-    for (unsigned i = 0; i < DEVS_REGCACHE_NUM_ENTRIES; ++i) {
+    if (!cache->entries)
+        return;
+    for (unsigned i = 0; i < cache->capacity; ++i) {
         devs_regcache_entry_t *q = &cache->entries[i];
-        if (q->role_idx == role_idx && q->last_refresh_time > min_time)
+        if (q->service_command && q->role_idx == role_idx && q->last_refresh_time > min_time)
             q->last_refresh_time = min_time;
     }
 }
 
 void devs_regcache_free_role(devs_regcache_t *cache, unsigned role_idx) {
-    for (unsigned i = 0; i < DEVS_REGCACHE_NUM_ENTRIES; ++i) {
+    if (!cache->entries)
+        return;
+    for (unsigned i = 0; i < cache->capacity; ++i) {
         devs_regcache_entry_t *q = &cache->entries[i];
-        if (q->role_idx == role_idx)
+        if (q->service_command && q->role_idx == role_idx)
             devs_regcache_free(cache, q);
     }
 }
 
+// entries for role_idx/service_command with any argument
 devs_regcache_entry_t *devs_regcache_next(devs_regcache_t *cache, unsigned role_idx,
                                           unsigned service_command, devs_regcache_entry_t *prev) {
-    if (!service_command)
+    if (!service_command || !cache->entries)
         return NULL;
-    devs_regcache_entry_t *end = &cache->entries[DEVS_REGCACHE_NUM_ENTRIES];
-    if (!prev)
-        prev = &cache->entries[0];
-    while (prev < end) {
-        if (prev->service_command == service_command && prev->role_idx == role_idx)
-            return prev;
-        prev++;
+    unsigned link =
+        prev ? prev->hash_next : cache->buckets[bucket_of(cache, role_idx, service_command)];
+    while (link) {
+        devs_regcache_entry_t *q = ENTRY(cache, link);
+        if (q->service_command == service_command && q->role_idx == role_idx)
+            return q;
+        link = q->hash_next;
     }
     return NULL;
-}
\ No newline at end of file
+}
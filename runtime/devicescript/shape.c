@@ -0,0 +1,154 @@
+#include "devs_internal.h"
+
+// #define LOG_TAG "shape"
+#include "devs_logging.h"
+
+// Maps created by the same code add the same keys in the same order. Instead of storing the keys
+// in every map, a map points to a shape, which holds the keys; the map only holds the values.
+// Shapes form a transition tree rooted at ctx->root_shape. Maps fall back to dictionary mode
+// (see objects.c) when a shape can't be found or created under the limits below, or when there
+// is no memory for it. Links to children are weak: a shape not used by any map (or a descendant)
+// is freed by the GC and unlinked from its parent, see clear_dead_shapes() in gc_alloc.c.
+
+// max number of keys in a shaped map
+#define DEVS_SHAPE_MAX_KEYS 32
+// max number of different keys added after a given shape
+#define DEVS_SHAPE_MAX_CHILDREN 8
+// shapes with at least that many keys get a hash index
+#define DEVS_SHAPE_INDEX_MIN 8
+
+#if JD_HOSTED
+#define DEVS_MAX_SHAPES 1024
+#else
+#define DEVS_MAX_SHAPES 128
+#endif
+
+static inline unsigned key_hash(value_t key, unsigned bits) {
+    uint32_t h = devs_handle_value(key) ^ (uint32_t)(key.u64 >> 32);
+    return (h * 0x9e3779b1) >> (32 - bits);
+}
+
+static devs_map_shape_t *alloc_shape(devs_ctx_t *ctx) {
+    if (ctx->num_shapes >= DEVS_MAX_SHAPES)
+        return NULL;
+    // no devs_oom() here, maps can do without shapes
+    devs_map_shape_t *sh = jd_gc_any_try_alloc(ctx->gc, DEVS_GC_TAG_SHAPE, sizeof(devs_map_shape_t));
+    if (sh)
+        ctx->num_shapes++;
+    return sh;
+}
+
+devs_map_shape_t *devs_shape_root(devs_ctx_t *ctx) {
+    if (ctx->root_shape == NULL)
+        ctx->root_shape = alloc_shape(ctx);
+    return ctx->root_shape;
+}
+
+int devs_shape_find(devs_map_shape_t *sh, value_t key) {
+    value_t *keys = sh->keys;
+    if (sh->index) {
+        unsigned mask = (1U << sh->index_bits) - 1;
+        for (unsigned h = key_hash(key, sh->index_bits);; h = (h + 1) & mask) {
+            unsigned e = sh->index[h];
+            if (e == 0)
+                return -1;
+            if (keys[e - 1].u64 == key.u64)
+                return e - 1;
+        }
+    } else {
+        unsigned len = sh->length;
+        for (unsigned i = 0; i < len; ++i)
+            if (keys[i].u64 == key.u64)
+                return i;
+        return -1;
+    }
+}
+
+// returns a pinned index, or NULL (in which case the shape is searched linearly)
+static uint16_t *build_index(devs_ctx_t *ctx, const value_t *keys, unsigned len, unsigned *bitsp) {
+    unsigned bits = 1;
+    while ((1U << bits) < len * 2U)
+        bits++;
+    unsigned sz = 1U << bits;
+    uint16_t *index = jd_gc_try_alloc_pinned(ctx->gc, sz * sizeof(uint16_t));
+    if (!index)
+        return NULL;
+    for (unsigned i = 0; i < len; ++i) {
+        unsigned h = key_hash(keys[i], bits);
+        while (index[h])
+            h = (h + 1) & (sz - 1);
+        index[h] = i + 1;
+    }
+    *bitsp = bits;
+    return index;
+}
+
+devs_map_shape_t *devs_shape_transition(devs_ctx_t *ctx, devs_map_shape_t *sh, value_t key) {
+    // keys of shapes are never scanned by GC, so they have to be static
+    if (devs_handle_type(key) != DEVS_HANDLE_TYPE_IMG_BUFFERISH)
+        return NULL;
+
+    for (devs_map_shape_t *p = sh->first_child; p; p = p->next_sibling) {
+        if (p->length && p->keys[p->length - 1].u64 == key.u64)
+            return p;
+    }
+
+    unsigned len = sh->length;
+    if (len >= DEVS_SHAPE_MAX_KEYS || sh->num_children >= DEVS_SHAPE_MAX_CHILDREN)
+        return NULL;
+
+    // only the first child can use the slot past the parent's keys
+    bool share_keys = sh->num_children == 0 && len < sh->keys_capacity;
+    value_t *keys = NULL;
+    unsigned cap = 0;
+    if (!share_keys) {
+        cap = len < 4 ? 4 : len * 2;
+        if (cap > DEVS_SHAPE_MAX_KEYS)
+            cap = DEVS_SHAPE_MAX_KEYS;
+        // stays pinned until the new shape is linked
+        keys = jd_gc_try_alloc_pinned(ctx->gc, cap * sizeof(value_t));
+        if (!keys)
+            return NULL;
+        if (len)
+            memcpy(keys, sh->keys, len * sizeof(value_t));
+    } else {
+        keys = sh->keys;
+        cap = sh->keys_capacity;
+    }
+    // the slot is unused: only a child sharing the keys (there is none) could have written it
+    keys[len] = key;
+
+    uint16_t *index = NULL;
+    unsigned index_bits = 0;
+    if (len + 1 >= DEVS_SHAPE_INDEX_MIN)
+        index = build_index(ctx, keys, len + 1, &index_bits);
+
+    // allocated last: until the caller stores it in a map, the new shape is only referenced by
+    // the (weak) child list of its parent, and would be freed by a GC
+    devs_map_shape_t *res = alloc_shape(ctx);
+    if (!res) {
+        jd_gc_free(ctx->gc, index);
+        if (!share_keys)
+            jd_gc_free(ctx->gc, keys);
+        return NULL;
+    }
+
+    res->parent = sh;
+    res->next_sibling = sh->first_child;
+    sh->first_child = res;
+    sh->num_children++;
+
+    res->keys = keys;
+    res->keys_capacity = cap;
+    res->length = len + 1;
+    if (!share_keys)
+        jd_gc_unpin(ctx->gc, keys);
+
+    res->index = index;
+    res->index_bits = index_bits;
+    jd_gc_unpin(ctx->gc, index);
+
+    LOG("new shape %p len=%d", res, res->length);
+
+    return res;
+}
@@ -12,8 +12,8 @@ void devs_log_value(devs_ctx_t *ctx, const char *lbl, value_t v) {
                 DMESG("%c  ...", c0);
                 break;
             }
-            DMESG("%c  %s =>", c0, devs_show_value(ctx, map->data[i * 2]));
-            DMESG("%c    %s", c0, devs_show_value(ctx, map->data[i * 2 + 1]));
+            DMESG("%c  %s =>", c0, devs_show_value(ctx, devs_map_key_at(map, i)));
+            DMESG("%c    %s", c0, devs_show_value(ctx, *devs_map_value_ptr(map, i)));
         }
     }
 }
@@ -181,9 +181,11 @@ value_t devs_value_to_string(devs_ctx_t *ctx, value_t v) {
             return buffer_to_string(ctx, v);
         case DEVS_GC_TAG_PACKET: {
             devs_packet_t *pkt = devs_handle_ptr_value(ctx, v);
+            unsigned sz;
+            devs_packet_data(pkt, &sz);
             return devs_string_sprintf(ctx, "[Packet: %s cmd=%x sz=%d]",
                                        devs_role_name(ctx, pkt->roleidx), pkt->service_command,
-                                       pkt->payload->length);
+                                       sz);
         }
         case DEVS_GC_TAG_IMAGE: {
             devs_gimage_t *img = devs_handle_ptr_value(ctx, v);
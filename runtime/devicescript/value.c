@@ -72,10 +72,7 @@ int_sign:
 }
 
 value_t devs_value_from_int(int v) {
-    value_t r;
-    r.exp_sign = DEVS_INT_TAG;
-    r.val_int32 = v;
-    return r;
+    return devs_value_from_i32(v);
 }
 
 value_t devs_value_from_bool(int v) {
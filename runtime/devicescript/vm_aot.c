@@ -0,0 +1,40 @@
+#include "devs_internal.h"
+#include "devs_vm_internal.h"
+
+// identifies the bytecode that AOT-translated functions were generated from
+uint32_t devs_aot_image_hash(const uint8_t *img) {
+    const devs_img_header_t *hd = (const devs_img_header_t *)img;
+    uint32_t h = jd_hash_fnv1a(img, sizeof(*hd));
+    h = h * 0x01000193 ^ jd_hash_fnv1a(img + hd->functions.start, hd->functions.length);
+    h = h * 0x01000193 ^ jd_hash_fnv1a(img + hd->functions_data.start, hd->functions_data.length);
+    return h;
+}
+
+#if DEVS_VM_AOT
+
+// overridden by the C file generated with `jdcli -A:out.c prog.devs`
+__attribute__((weak)) const devs_aot_image_t *devs_aot_get_image(void) {
+    return NULL;
+}
+
+static uint32_t aot_ctx_seq_no;
+static const devs_aot_fn_t *aot_functions;
+
+devs_aot_fn_t devs_vm_aot_lookup(devs_ctx_t *ctx, const devs_function_desc_t *func) {
+    if (aot_ctx_seq_no != ctx->ctx_seq_no) {
+        aot_ctx_seq_no = ctx->ctx_seq_no;
+        aot_functions = NULL;
+        const devs_aot_image_t *aot = devs_aot_get_image();
+        if (aot && aot->num_functions == devs_img_num_functions(ctx->img) &&
+            aot->hash == devs_aot_image_hash(ctx->img.data)) {
+            DMESG("using AOT code for %u functions", (unsigned)aot->num_functions);
+            aot_functions = aot->functions;
+        }
+    }
+
+    if (!aot_functions)
+        return NULL;
+    return aot_functions[func - devs_img_get_function(ctx->img, 0)];
+}
+
+#endif
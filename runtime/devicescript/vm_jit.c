@@ -0,0 +1,866 @@
+// Baseline template JIT for x86-64 hosts (DEVS_VM_JIT).
+//
+// Hot functions are translated to machine code with the same contract as AOT functions
+// (devs_aot_fn_t): run frame from frame->pc while it is the current function, return remaining
+// maxsteps. Every instruction gets the step and suspension checks of exec_steps(); most then
+// call their vm_ops.c handler through jit_stmt()/jit_expr(). Direct constants, local loads and
+// stores, int32 add/sub/compare and jumps have inline fast paths, which fall back to the
+// handler when their operands aren't what they expect.
+
+#include "devs_internal.h"
+#include "devs_vm_internal.h"
+
+#if DEVS_VM_JIT
+
+#include <sys/mman.h>
+
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RSI 6
+#define RDI 7
+#define R8 8
+#define R9 9
+#define R12 12
+#define R13 13
+#define R14 14
+#define R15 15
+
+// condition codes
+#define CC_O 0x0
+#define CC_B 0x2
+#define CC_AE 0x3
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_A 0x7
+#define CC_L 0xc
+#define CC_LE 0xe
+
+// registers in generated code: rbx=ctx, r12=frame, r13d=maxsteps, r14=jump table
+#define CTX RBX
+#define FRAME R12
+#define STEPS R13
+#define TABLE R14
+
+#define OFF_CURR_FN offsetof(devs_ctx_t, curr_fn)
+#define OFF_SUSPENSION offsetof(devs_ctx_t, suspension)
+#define OFF_PREEMPT offsetof(devs_ctx_t, preempt_pending)
+#define OFF_STACK_TOP offsetof(devs_ctx_t, stack_top)
+#define OFF_STACK offsetof(devs_ctx_t, the_stack)
+#define OFF_PC offsetof(devs_activation_t, pc)
+#define OFF_SLOTS offsetof(devs_activation_t, slots)
+
+STATIC_ASSERT(sizeof(devs_pc_t) == 2);
+STATIC_ASSERT(sizeof(((devs_ctx_t *)NULL)->stack_top) == 1);
+
+#define INT_TAG 0xffffffff00000000ULL
+
+typedef struct {
+    uint8_t *code;
+    uint32_t size;
+    uint32_t ptr;
+    const devs_function_desc_t *func;
+    // code offset of every instruction, indexed by pc - func->start; 0 if not an instruction
+    uint32_t *insn_off;
+    // rel32 jumps to instructions not emitted yet
+    uint32_t *fixup_at;
+    uint16_t *fixup_pc;
+    uint32_t num_fixups;
+    uint32_t lbl_dispatch;
+    uint32_t lbl_exit;
+    uint32_t lbl_bad;
+} jit_t;
+
+typedef struct {
+    uint32_t num_calls;
+    uint32_t num_steps;
+    uint8_t failed;
+    devs_aot_fn_t code;
+    uint32_t code_size;
+} jit_fn_t;
+
+static struct {
+    uint32_t ctx_seq_no;
+    uint32_t num_fns;
+    jit_fn_t *fns;
+} jit_state;
+
+/*
+ * Helpers called from generated code
+ */
+
+// returns non-zero when execution doesn't continue with the next instruction
+static int jit_stmt(devs_activation_t *frame, devs_ctx_t *ctx, devs_vm_stmt_handler_t fn,
+                    unsigned next, unsigned pc, int32_t arg) {
+    frame->pc = next;
+    ctx->jmp_pc = pc;
+    ctx->literal_int = arg;
+    ctx->stack_top_for_gc = ctx->stack_top;
+    fn(frame, ctx);
+    if (ctx->stack_top)
+        devs_invalid_program(ctx, 60103);
+    if (ctx->in_throw)
+        devs_process_throw(ctx);
+    return ctx->curr_fn != frame || frame->pc != next;
+}
+
+static int jit_expr(devs_activation_t *frame, devs_ctx_t *ctx, devs_vm_expr_handler_t fn,
+                    unsigned next, unsigned pc, int32_t arg) {
+    frame->pc = next;
+    ctx->jmp_pc = pc;
+    ctx->literal_int = arg;
+    ctx->stack_top_for_gc = ctx->stack_top;
+    value_t v = fn(frame, ctx);
+    devs_vm_push(ctx, v);
+    if (ctx->in_throw)
+        devs_process_throw(ctx);
+    return ctx->curr_fn != frame || frame->pc != next;
+}
+
+static void jit_push(devs_ctx_t *ctx, uint64_t v) {
+    value_t tmp;
+    tmp.u64 = v;
+    devs_vm_push(ctx, tmp);
+}
+
+static void jit_safe_point(devs_ctx_t *ctx) {
+    if (ctx->preempt_pending && ctx->curr_fn && !ctx->in_throw)
+        devs_fiber_preempt(ctx);
+}
+
+static void jit_fail(devs_ctx_t *ctx, unsigned code) {
+    devs_invalid_program(ctx, code);
+}
+
+/*
+ * Encoder
+ */
+
+static void b1(jit_t *j, uint8_t v) {
+    if (j->ptr < j->size)
+        j->code[j->ptr] = v;
+    j->ptr++;
+}
+
+static void b2(jit_t *j, uint16_t v) {
+    b1(j, v);
+    b1(j, v >> 8);
+}
+
+static void b4(jit_t *j, uint32_t v) {
+    b2(j, v);
+    b2(j, v >> 16);
+}
+
+static void b8(jit_t *j, uint64_t v) {
+    b4(j, v);
+    b4(j, v >> 32);
+}
+
+static void rex(jit_t *j, int w, int reg, int index, int base) {
+    uint8_t r = 0x40 | (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+    if (r != 0x40)
+        b1(j, r);
+}
+
+// [base + disp32]
+static void mem(jit_t *j, int reg, int base, int32_t disp) {
+    b1(j, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == 4)
+        b1(j, 0x24);
+    b4(j, disp);
+}
+
+// [base + index*8 + disp32]
+static void mem_idx8(jit_t *j, int reg, int base, int index, int32_t disp) {
+    b1(j, 0x84 | ((reg & 7) << 3));
+    b1(j, 0xc0 | ((index & 7) << 3) | (base & 7));
+    b4(j, disp);
+}
+
+static void modrm_rr(jit_t *j, int reg, int rm) {
+    b1(j, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+static void push_r(jit_t *j, int r) {
+    rex(j, 0, 0, 0, r);
+    b1(j, 0x50 + (r & 7));
+}
+
+static void pop_r(jit_t *j, int r) {
+    rex(j, 0, 0, 0, r);
+    b1(j, 0x58 + (r & 7));
+}
+
+static void mov_rr64(jit_t *j, int dst, int src) {
+    rex(j, 1, src, 0, dst);
+    b1(j, 0x89);
+    modrm_rr(j, src, dst);
+}
+
+static void mov_rr32(jit_t *j, int dst, int src) {
+    rex(j, 0, src, 0, dst);
+    b1(j, 0x89);
+    modrm_rr(j, src, dst);
+}
+
+static void mov_imm32(jit_t *j, int r, uint32_t v) {
+    rex(j, 0, 0, 0, r);
+    b1(j, 0xb8 + (r & 7));
+    b4(j, v);
+}
+
+static void mov_imm64(jit_t *j, int r, uint64_t v) {
+    rex(j, 1, 0, 0, r);
+    b1(j, 0xb8 + (r & 7));
+    b8(j, v);
+}
+
+static void load64(jit_t *j, int r, int base, int32_t disp) {
+    rex(j, 1, r, 0, base);
+    b1(j, 0x8b);
+    mem(j, r, base, disp);
+}
+
+static void load64_idx8(jit_t *j, int r, int base, int index, int32_t disp) {
+    rex(j, 1, r, index, base);
+    b1(j, 0x8b);
+    mem_idx8(j, r, base, index, disp);
+}
+
+static void store64_idx8(jit_t *j, int r, int base, int index, int32_t disp) {
+    rex(j, 1, r, index, base);
+    b1(j, 0x89);
+    mem_idx8(j, r, base, index, disp);
+}
+
+static void store64(jit_t *j, int r, int base, int32_t disp) {
+    rex(j, 1, r, 0, base);
+    b1(j, 0x89);
+    mem(j, r, base, disp);
+}
+
+static void movzx8(jit_t *j, int r, int base, int32_t disp) {
+    rex(j, 0, r, 0, base);
+    b1(j, 0x0f);
+    b1(j, 0xb6);
+    mem(j, r, base, disp);
+}
+
+static void movzx16(jit_t *j, int r, int base, int32_t disp) {
+    rex(j, 0, r, 0, base);
+    b1(j, 0x0f);
+    b1(j, 0xb7);
+    mem(j, r, base, disp);
+}
+
+// r has to be one of al, cl, dl, bl
+static void store8(jit_t *j, int r, int base, int32_t disp) {
+    rex(j, 0, r, 0, base);
+    b1(j, 0x88);
+    mem(j, r, base, disp);
+}
+
+static void store8_imm(jit_t *j, int base, int32_t disp, uint8_t v) {
+    rex(j, 0, 0, 0, base);
+    b1(j, 0xc6);
+    mem(j, 0, base, disp);
+    b1(j, v);
+}
+
+static void store16_imm(jit_t *j, int base, int32_t disp, uint16_t v) {
+    b1(j, 0x66);
+    rex(j, 0, 0, 0, base);
+    b1(j, 0xc7);
+    mem(j, 0, base, disp);
+    b2(j, v);
+}
+
+static void cmp8_imm(jit_t *j, int base, int32_t disp, uint8_t v) {
+    rex(j, 0, 0, 0, base);
+    b1(j, 0x80);
+    mem(j, 7, base, disp);
+    b1(j, v);
+}
+
+// cmp [base + disp], r (64 bit)
+static void cmp64_mem(jit_t *j, int r, int base, int32_t disp) {
+    rex(j, 1, r, 0, base);
+    b1(j, 0x39);
+    mem(j, r, base, disp);
+}
+
+static void cmp32_imm(jit_t *j, int r, int32_t v) {
+    rex(j, 0, 0, 0, r);
+    b1(j, 0x81);
+    modrm_rr(j, 7, r);
+    b4(j, v);
+}
+
+static void sub32_imm(jit_t *j, int r, int32_t v) {
+    rex(j, 0, 0, 0, r);
+    b1(j, 0x81);
+    modrm_rr(j, 5, r);
+    b4(j, v);
+}
+
+// add/sub/cmp/or/test dst, src
+#define ALU_ADD 0x01
+#define ALU_OR 0x09
+#define ALU_SUB 0x29
+#define ALU_CMP 0x39
+#define ALU_TEST 0x85
+static void alu32(jit_t *j, uint8_t op, int dst, int src) {
+    rex(j, 0, src, 0, dst);
+    b1(j, op);
+    modrm_rr(j, src, dst);
+}
+
+static void alu64(jit_t *j, uint8_t op, int dst, int src) {
+    rex(j, 1, src, 0, dst);
+    b1(j, op);
+    modrm_rr(j, src, dst);
+}
+
+static void shr64_imm(jit_t *j, int r, uint8_t v) {
+    rex(j, 1, 0, 0, r);
+    b1(j, 0xc1);
+    modrm_rr(j, 5, r);
+    b1(j, v);
+}
+
+// inc/dec r (32 bit)
+static void incdec32(jit_t *j, int r, bool dec) {
+    rex(j, 0, 0, 0, r);
+    b1(j, 0xff);
+    modrm_rr(j, dec ? 1 : 0, r);
+}
+
+static void cmov32(jit_t *j, int cc, int dst, int src) {
+    rex(j, 0, dst, 0, src);
+    b1(j, 0x0f);
+    b1(j, 0x40 | cc);
+    modrm_rr(j, dst, src);
+}
+
+static void call_abs(jit_t *j, const void *fn) {
+    mov_imm64(j, RAX, (uintptr_t)fn);
+    b1(j, 0xff);
+    b1(j, 0xd0);
+}
+
+static void patch32(jit_t *j, uint32_t at, uint32_t target) {
+    if (at + 4 <= j->size) {
+        int32_t rel = target - (at + 4);
+        memcpy(j->code + at, &rel, 4);
+    }
+}
+
+static void jmp_to(jit_t *j, uint32_t target) {
+    b1(j, 0xe9);
+    uint32_t at = j->ptr;
+    b4(j, 0);
+    patch32(j, at, target);
+}
+
+static void jcc_to(jit_t *j, int cc, uint32_t target) {
+    b1(j, 0x0f);
+    b1(j, 0x80 | cc);
+    uint32_t at = j->ptr;
+    b4(j, 0);
+    patch32(j, at, target);
+}
+
+// forward jcc within the current template; returns position to pass to here()
+static uint32_t jcc_fwd(jit_t *j, int cc) {
+    b1(j, 0x0f);
+    b1(j, 0x80 | cc);
+    uint32_t at = j->ptr;
+    b4(j, 0);
+    return at;
+}
+
+static void here(jit_t *j, uint32_t at) {
+    patch32(j, at, j->ptr);
+}
+
+// jump to instruction at pc, possibly not emitted yet
+static void jmp_pc(jit_t *j, unsigned pc) {
+    unsigned idx = pc - j->func->start;
+    if (j->insn_off[idx] && j->insn_off[idx] <= j->ptr) {
+        jmp_to(j, j->insn_off[idx]);
+    } else {
+        b1(j, 0xe9);
+        j->fixup_at[j->num_fixups] = j->ptr;
+        j->fixup_pc[j->num_fixups] = pc;
+        j->num_fixups++;
+        b4(j, 0);
+    }
+}
+
+/*
+ * Templates
+ */
+
+// same as the loop condition in exec_steps()
+static void emit_step_check(jit_t *j) {
+    incdec32(j, STEPS, true);
+    jcc_to(j, CC_E, j->lbl_exit);
+    cmp8_imm(j, CTX, OFF_SUSPENSION, 0);
+    jcc_to(j, CC_NE, j->lbl_exit);
+}
+
+static void emit_generic(jit_t *j, uint8_t op, unsigned pc, unsigned next, int32_t arg) {
+    mov_rr64(j, RDI, FRAME);
+    mov_rr64(j, RSI, CTX);
+    mov_imm64(j, RDX, (uintptr_t)devs_vm_op_handlers[op]);
+    mov_imm32(j, RCX, next);
+    mov_imm32(j, R8, pc);
+    mov_imm32(j, R9, arg);
+    call_abs(j, (DEVS_OP_PROPS[op] & DEVS_BYTECODEFLAG_IS_STMT) ? (const void *)jit_stmt
+                                                                 : (const void *)jit_expr);
+    alu32(j, ALU_TEST, RAX, RAX);
+    jcc_to(j, CC_NE, j->lbl_dispatch);
+}
+
+// ecx := stack_top; jumps to returned fixup if there's no room for another value
+static uint32_t emit_push_check(jit_t *j) {
+    movzx8(j, RCX, CTX, OFF_STACK_TOP);
+    cmp32_imm(j, RCX, DEVS_MAX_STACK_DEPTH);
+    return jcc_fwd(j, CC_AE);
+}
+
+// the_stack[ecx++] := rax
+static void emit_push_rax(jit_t *j) {
+    store64_idx8(j, RAX, CTX, RCX, OFF_STACK);
+    incdec32(j, RCX, false);
+    store8(j, RCX, CTX, OFF_STACK_TOP);
+}
+
+static void emit_const(jit_t *j, uint64_t v, unsigned next) {
+    uint32_t full = emit_push_check(j);
+    mov_imm64(j, RAX, v);
+    emit_push_rax(j);
+    jmp_pc(j, next);
+    here(j, full);
+    mov_rr64(j, RDI, CTX);
+    mov_imm64(j, RSI, v);
+    call_abs(j, jit_push);
+    jmp_to(j, j->lbl_dispatch);
+}
+
+// returns fixup for the slow path
+static uint32_t emit_load_local(jit_t *j, unsigned idx, unsigned next) {
+    uint32_t full = emit_push_check(j);
+    load64(j, RAX, FRAME, OFF_SLOTS + idx * sizeof(value_t));
+    emit_push_rax(j);
+    jmp_pc(j, next);
+    return full;
+}
+
+static uint32_t emit_store_local(jit_t *j, unsigned idx, unsigned next) {
+    // store is a statement - the value has to be the only thing on the stack
+    movzx8(j, RCX, CTX, OFF_STACK_TOP);
+    cmp32_imm(j, RCX, 1);
+    uint32_t slow = jcc_fwd(j, CC_NE);
+    load64(j, RAX, CTX, OFF_STACK);
+    store64(j, RAX, FRAME, OFF_SLOTS + idx * sizeof(value_t));
+    store8_imm(j, CTX, OFF_STACK_TOP, 0);
+    jmp_pc(j, next);
+    return slow;
+}
+
+// rax, rdx := two top values, if they're both ints; ecx := stack_top; returns fixups for slow path
+static void emit_pop2_ints(jit_t *j, uint32_t *slow) {
+    movzx8(j, RCX, CTX, OFF_STACK_TOP);
+    cmp32_imm(j, RCX, 2);
+    slow[0] = jcc_fwd(j, CC_B);
+    load64_idx8(j, RAX, CTX, RCX, OFF_STACK - 2 * sizeof(value_t));
+    load64_idx8(j, RDX, CTX, RCX, OFF_STACK - sizeof(value_t));
+    mov_rr64(j, RSI, RAX);
+    shr64_imm(j, RSI, 32);
+    cmp32_imm(j, RSI, -1);
+    slow[1] = jcc_fwd(j, CC_NE);
+    mov_rr64(j, RSI, RDX);
+    shr64_imm(j, RSI, 32);
+    cmp32_imm(j, RSI, -1);
+    slow[2] = jcc_fwd(j, CC_NE);
+}
+
+// replace two top values with rax
+static void emit_replace2(jit_t *j) {
+    store64_idx8(j, RAX, CTX, RCX, OFF_STACK - 2 * sizeof(value_t));
+    incdec32(j, RCX, true);
+    store8(j, RCX, CTX, OFF_STACK_TOP);
+}
+
+static void emit_arith(jit_t *j, uint8_t alu, uint32_t *slow, unsigned next) {
+    emit_pop2_ints(j, slow);
+    alu32(j, alu, RAX, RDX);
+    // overflow needs a double; the stack is still intact for the handler
+    slow[3] = jcc_fwd(j, CC_O);
+    mov_imm64(j, RSI, INT_TAG);
+    alu64(j, ALU_OR, RAX, RSI);
+    emit_replace2(j);
+    jmp_pc(j, next);
+}
+
+static void emit_compare(jit_t *j, int cc, uint32_t *slow, unsigned next) {
+    emit_pop2_ints(j, slow);
+    alu32(j, ALU_CMP, RAX, RDX);
+    // mov doesn't affect flags
+    mov_imm32(j, RAX, DEVS_SPECIAL_FALSE);
+    mov_imm32(j, RSI, DEVS_SPECIAL_TRUE);
+    cmov32(j, cc, RAX, RSI);
+    emit_replace2(j);
+    jmp_pc(j, next);
+}
+
+static void emit_jump(jit_t *j, unsigned pc, unsigned target) {
+    store16_imm(j, FRAME, OFF_PC, target);
+    if (target > pc) {
+        jmp_pc(j, target);
+    } else {
+        // backward jumps are safe points, see safe_point() in vm_ops.c
+        cmp8_imm(j, CTX, OFF_PREEMPT, 0);
+        uint32_t preempt = jcc_fwd(j, CC_NE);
+        jmp_pc(j, target);
+        here(j, preempt);
+        mov_rr64(j, RDI, CTX);
+        call_abs(j, jit_safe_point);
+        jmp_to(j, j->lbl_dispatch);
+    }
+}
+
+static uint32_t emit_jmp_z(jit_t *j, unsigned pc, unsigned target, unsigned next) {
+    movzx8(j, RCX, CTX, OFF_STACK_TOP);
+    cmp32_imm(j, RCX, 1);
+    uint32_t slow = jcc_fwd(j, CC_NE);
+    load64(j, RAX, CTX, OFF_STACK);
+    // booleans and ints; everything else goes through devs_value_to_bool()
+    mov_imm32(j, RDX, DEVS_SPECIAL_TRUE);
+    alu64(j, ALU_CMP, RAX, RDX);
+    uint32_t truthy0 = jcc_fwd(j, CC_E);
+    mov_imm32(j, RDX, DEVS_SPECIAL_FALSE);
+    alu64(j, ALU_CMP, RAX, RDX);
+    uint32_t falsy = jcc_fwd(j, CC_E);
+    mov_rr64(j, RDX, RAX);
+    shr64_imm(j, RDX, 32);
+    cmp32_imm(j, RDX, -1);
+    uint32_t slow2 = jcc_fwd(j, CC_NE);
+    alu32(j, ALU_TEST, RAX, RAX);
+    uint32_t truthy1 = jcc_fwd(j, CC_NE);
+
+    here(j, falsy);
+    store8_imm(j, CTX, OFF_STACK_TOP, 0);
+    emit_jump(j, pc, target);
+
+    here(j, truthy0);
+    here(j, truthy1);
+    store8_imm(j, CTX, OFF_STACK_TOP, 0);
+    jmp_pc(j, next);
+
+    // both slow paths end up in the same place; chain them
+    here(j, slow2);
+    return slow;
+}
+
+// same encoding as devs_vm_fetch_int()
+static int decode_int(const uint8_t *code, unsigned *pc, unsigned end, int32_t *res) {
+    if (*pc >= end)
+        return -1;
+    uint8_t v = code[(*pc)++];
+    if (v < DEVS_FIRST_MULTIBYTE_INT) {
+        *res = v;
+        return 0;
+    }
+    bool n = !!(v & 4);
+    int len = (v & 3) + 1;
+    int32_t r = 0;
+    for (int i = 0; i < len; ++i) {
+        if (*pc >= end)
+            return -1;
+        r <<= 8;
+        r |= code[(*pc)++];
+    }
+    *res = n ? -r : r;
+    return 0;
+}
+
+static bool is_insn(jit_t *j, const uint8_t *starts, int target) {
+    int idx = target - (int)j->func->start;
+    return idx >= 0 && idx < (int)j->func->length && starts[idx];
+}
+
+static void emit_insn(jit_t *j, const uint8_t *imgdata, const uint8_t *starts, unsigned pc,
+                      unsigned *pnext) {
+    const devs_function_desc_t *func = j->func;
+    unsigned end = func->start + func->length;
+    unsigned next = pc + 1;
+    uint8_t op = imgdata[pc];
+
+    emit_step_check(j);
+
+    if (op >= DEVS_DIRECT_CONST_OP) {
+        value_t v = devs_value_from_int(op - DEVS_DIRECT_CONST_OP - DEVS_DIRECT_CONST_OFFSET);
+        store16_imm(j, FRAME, OFF_PC, next);
+        emit_const(j, v.u64, next);
+        *pnext = next;
+        return;
+    }
+
+    int32_t arg = 0;
+    if (op >= DEVS_OP_PAST_LAST ||
+        ((DEVS_OP_PROPS[op] & DEVS_BYTECODEFLAG_TAKES_NUMBER) &&
+         decode_int(imgdata, &next, end, &arg) != 0)) {
+        mov_rr64(j, RDI, CTX);
+        mov_imm32(j, RSI, op >= DEVS_OP_PAST_LAST ? 60102 : 60100);
+        call_abs(j, jit_fail);
+        jmp_to(j, j->lbl_exit);
+        *pnext = end;
+        return;
+    }
+    *pnext = next;
+
+    int target = pc + arg;
+    uint32_t slow[4];
+    unsigned num_slow = 0;
+
+    switch (op) {
+    case DEVS_EXPRx_LOAD_LOCAL:
+        if ((unsigned)arg < func->num_slots) {
+            store16_imm(j, FRAME, OFF_PC, next);
+            slow[num_slow++] = emit_load_local(j, arg, next);
+        }
+        break;
+    case DEVS_STMTx1_STORE_LOCAL:
+        if ((unsigned)arg < func->num_slots) {
+            store16_imm(j, FRAME, OFF_PC, next);
+            slow[num_slow++] = emit_store_local(j, arg, next);
+        }
+        break;
+    case DEVS_EXPR2_ADD:
+    case DEVS_EXPR2_SUB:
+        store16_imm(j, FRAME, OFF_PC, next);
+        emit_arith(j, op == DEVS_EXPR2_ADD ? ALU_ADD : ALU_SUB, slow, next);
+        num_slow = 4;
+        break;
+    case DEVS_EXPR2_LT:
+    case DEVS_EXPR2_LE:
+    case DEVS_EXPR2_EQ:
+    case DEVS_EXPR2_NE:
+        store16_imm(j, FRAME, OFF_PC, next);
+        emit_compare(j,
+                     op == DEVS_EXPR2_LT   ? CC_L
+                     : op == DEVS_EXPR2_LE ? CC_LE
+                     : op == DEVS_EXPR2_EQ ? CC_E
+                                           : CC_NE,
+                     slow, next);
+        num_slow = 3;
+        break;
+    case DEVS_STMTx_JMP:
+        if (is_insn(j, starts, target)) {
+            emit_jump(j, pc, target);
+            return;
+        }
+        break;
+    case DEVS_STMTx1_JMP_Z:
+        if (is_insn(j, starts, target)) {
+            store16_imm(j, FRAME, OFF_PC, next);
+            slow[num_slow++] = emit_jmp_z(j, pc, target, next);
+        }
+        break;
+    }
+
+    for (unsigned i = 0; i < num_slow; ++i)
+        here(j, slow[i]);
+    emit_generic(j, op, pc, next, arg);
+}
+
+static void emit_function(jit_t *j, const uint8_t *imgdata, const uint8_t *starts) {
+    const devs_function_desc_t *func = j->func;
+    unsigned end = func->start + func->length;
+
+    // unsigned fn(devs_ctx_t *ctx, devs_activation_t *frame, unsigned maxsteps)
+    // 5 pushes keep the stack 16-byte aligned for calls
+    push_r(j, RBX);
+    push_r(j, R12);
+    push_r(j, R13);
+    push_r(j, R14);
+    push_r(j, R15);
+    mov_rr64(j, CTX, RDI);
+    mov_rr64(j, FRAME, RSI);
+    mov_rr32(j, STEPS, RDX);
+    // lea r14, [rip + table]; patched below
+    b1(j, 0x4c);
+    b1(j, 0x8d);
+    b1(j, 0x35);
+    uint32_t table_fixup = j->ptr;
+    b4(j, 0);
+
+    j->lbl_dispatch = j->ptr;
+    cmp64_mem(j, FRAME, CTX, OFF_CURR_FN);
+    uint32_t not_curr = jcc_fwd(j, CC_NE);
+    movzx16(j, RAX, FRAME, OFF_PC);
+    sub32_imm(j, RAX, func->start);
+    cmp32_imm(j, RAX, func->length);
+    uint32_t out_of_range = jcc_fwd(j, CC_A);
+    // movsxd rax, [r14 + rax*4]; add rax, r14; jmp rax
+    b1(j, 0x49);
+    b1(j, 0x63);
+    b1(j, 0x04);
+    b1(j, 0x86);
+    alu64(j, ALU_ADD, RAX, TABLE);
+    b1(j, 0xff);
+    b1(j, 0xe0);
+
+    j->lbl_exit = j->ptr;
+    here(j, not_curr);
+    mov_rr32(j, RAX, STEPS);
+    pop_r(j, R15);
+    pop_r(j, R14);
+    pop_r(j, R13);
+    pop_r(j, R12);
+    pop_r(j, RBX);
+    b1(j, 0xc3);
+
+    // not at instruction boundary
+    j->lbl_bad = j->ptr;
+    here(j, out_of_range);
+    mov_rr64(j, RDI, CTX);
+    mov_imm32(j, RSI, 60132);
+    call_abs(j, jit_fail);
+    jmp_to(j, j->lbl_exit);
+
+    unsigned pc = func->start;
+    while (pc < end) {
+        unsigned next;
+        j->insn_off[pc - func->start] = j->ptr;
+        emit_insn(j, imgdata, starts, pc, &next);
+        pc = next;
+    }
+
+    // falling off the end of the function
+    uint32_t end_off = j->ptr;
+    emit_step_check(j);
+    mov_rr64(j, RDI, CTX);
+    mov_imm32(j, RSI, 60100);
+    call_abs(j, jit_fail);
+    jmp_to(j, j->lbl_exit);
+
+    for (unsigned i = 0; i < j->num_fixups; ++i) {
+        unsigned idx = j->fixup_pc[i] - func->start;
+        patch32(j, j->fixup_at[i], idx < func->length ? j->insn_off[idx] : end_off);
+    }
+
+    // jump table, relative to itself
+    while (j->ptr & 3)
+        b1(j, 0xcc);
+    uint32_t table = j->ptr;
+    patch32(j, table_fixup, table);
+    for (unsigned i = 0; i <= func->length; ++i) {
+        uint32_t target = i == func->length ? end_off
+                          : starts[i]       ? j->insn_off[i]
+                                            : j->lbl_bad;
+        b4(j, target - table);
+    }
+}
+
+static devs_aot_fn_t jit_compile(devs_ctx_t *ctx, const devs_function_desc_t *func,
+                                 uint32_t *code_size) {
+    const uint8_t *imgdata = ctx->img.data;
+    unsigned len = func->length;
+    unsigned end = func->start + len;
+    jit_t j;
+    memset(&j, 0, sizeof(j));
+    j.func = func;
+
+    // first pass - instruction boundaries, for jump targets and the jump table
+    uint8_t *starts = jd_alloc(len + 1);
+    unsigned num_insns = 0;
+    for (unsigned pc = func->start; pc < end;) {
+        starts[pc - func->start] = 1;
+        num_insns++;
+        uint8_t op = imgdata[pc++];
+        int32_t arg;
+        if (op < DEVS_OP_PAST_LAST && (DEVS_OP_PROPS[op] & DEVS_BYTECODEFLAG_TAKES_NUMBER) &&
+            decode_int(imgdata, &pc, end, &arg) != 0)
+            break;
+    }
+
+    j.insn_off = jd_alloc((len + 1) * sizeof(uint32_t));
+    // at most two forward jumps per instruction
+    j.fixup_at = jd_alloc(2 * num_insns * sizeof(uint32_t) + 4);
+    j.fixup_pc = jd_alloc(2 * num_insns * sizeof(uint16_t) + 2);
+
+    // measure, then emit for real
+    emit_function(&j, imgdata, starts);
+    uint32_t size = (j.ptr + 4095) & ~4095;
+    void *code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        code = NULL;
+    } else {
+        j.code = code;
+        j.size = size;
+        j.ptr = 0;
+        j.num_fixups = 0;
+        memset(j.insn_off, 0, (len + 1) * sizeof(uint32_t));
+        emit_function(&j, imgdata, starts);
+        JD_ASSERT(j.ptr <= size);
+        if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+            munmap(code, size);
+            code = NULL;
+        }
+    }
+
+    jd_free(starts);
+    jd_free(j.insn_off);
+    jd_free(j.fixup_at);
+    jd_free(j.fixup_pc);
+
+    *code_size = size;
+    return (devs_aot_fn_t)code;
+}
+
+static void jit_free_all(void) {
+    for (unsigned i = 0; i < jit_state.num_fns; ++i) {
+        jit_fn_t *f = &jit_state.fns[i];
+        if (f->code)
+            munmap((void *)f->code, f->code_size);
+    }
+    jd_free(jit_state.fns);
+    jit_state.fns = NULL;
+    jit_state.num_fns = 0;
+}
+
+static jit_fn_t *jit_fn(devs_ctx_t *ctx, const devs_function_desc_t *func) {
+    if (jit_state.ctx_seq_no != ctx->ctx_seq_no) {
+        jit_free_all();
+        jit_state.ctx_seq_no = ctx->ctx_seq_no;
+        jit_state.num_fns = devs_img_num_functions(ctx->img);
+        jit_state.fns = jd_alloc(jit_state.num_fns * sizeof(jit_fn_t));
+    }
+    return &jit_state.fns[func - devs_img_get_function(ctx->img, 0)];
+}
+
+devs_aot_fn_t devs_vm_jit_lookup(devs_ctx_t *ctx, const devs_function_desc_t *func) {
+    jit_fn_t *f = jit_fn(ctx, func);
+    if (f->code || f->failed)
+        return f->code;
+    if (++f->num_calls < DEVS_VM_JIT_CALLS && f->num_steps < DEVS_VM_JIT_STEPS)
+        return NULL;
+    f->code = jit_compile(ctx, func, &f->code_size);
+    if (!f->code) {
+        DMESG("! JIT failed for %s", devs_img_fun_name(ctx->img, f - jit_state.fns));
+        f->failed = 1;
+    }
+    return f->code;
+}
+
+void devs_vm_jit_add_steps(devs_ctx_t *ctx, const devs_function_desc_t *func, unsigned steps) {
+    jit_fn_t *f = jit_fn(ctx, func);
+    f->num_steps += steps;
+}
+
+#endif
@@ -1,41 +1,10 @@
 #include "devs_internal.h"
 #include "devs_vm_internal.h"
 
-static inline uint8_t devs_vm_fetch_byte(devs_activation_t *frame, devs_ctx_t *ctx) {
-    if (frame->pc < frame->maxpc)
-        return ctx->img.data[frame->pc++];
-    devs_invalid_program(ctx, 60100);
-    return 0;
-}
-
 uint8_t devs_fetch_opcode(devs_activation_t *frame, devs_ctx_t *ctx) {
     return devs_vm_fetch_byte(frame, ctx);
 }
 
-static inline int32_t devs_vm_fetch_int(devs_activation_t *frame, devs_ctx_t *ctx) {
-    uint8_t v = devs_vm_fetch_byte(frame, ctx);
-    if (v < DEVS_FIRST_MULTIBYTE_INT)
-        return v;
-
-    int32_t r = 0;
-    bool n = !!(v & 4);
-    int len = (v & 3) + 1;
-    for (int i = 0; i < len; ++i) {
-        uint8_t b = devs_vm_fetch_byte(frame, ctx);
-        r <<= 8;
-        r |= b;
-    }
-
-    return n ? -r : r;
-}
-
-static inline void devs_vm_push(devs_ctx_t *ctx, value_t v) {
-    if (ctx->stack_top >= DEVS_MAX_STACK_DEPTH)
-        devs_invalid_program(ctx, 60101);
-    else
-        ctx->the_stack[ctx->stack_top++] = v;
-}
-
 void devs_dump_stackframe(devs_ctx_t *ctx, devs_activation_t *fn) {
     int idx = fn->func - devs_img_get_function(ctx->img, 0);
     DMESG("at %s_F%d (pc:%d) st=%d", devs_img_fun_name(ctx->img, idx), idx,
@@ -60,16 +29,25 @@ void devs_vm_set_debug(devs_ctx_t *ctx, bool en) {
         devs_vm_resume(ctx);
 }
 
-static inline unsigned brk_hash(unsigned pc) {
-    return pc & (DEVS_BRK_HASH_SIZE - 1);
-}
-
 static void recompute_brk_jump_tbl(devs_ctx_t *ctx) {
     memset(ctx->brk_jump_tbl, 0, DEVS_BRK_HASH_SIZE);
+    jd_free(ctx->brk_fn_map);
+    ctx->brk_fn_map = NULL;
+
     devs_brk_t *l = ctx->brk_list;
     for (unsigned i = 0; i < ctx->brk_count; ++i) {
-        if (l[i].pc && !ctx->brk_jump_tbl[brk_hash(l[i].pc)])
+        if (!l[i].pc)
+            continue;
+        if (!ctx->brk_jump_tbl[brk_hash(l[i].pc)])
             ctx->brk_jump_tbl[brk_hash(l[i].pc)] = i + 1;
+        const devs_function_desc_t *func = devs_function_by_pc(ctx, l[i].pc);
+        if (func) {
+            if (!ctx->brk_fn_map)
+                ctx->brk_fn_map =
+                    jd_alloc(((devs_img_num_functions(ctx->img) + 31) >> 5) * sizeof(uint32_t));
+            unsigned idx = func - devs_img_get_function(ctx->img, 0);
+            ctx->brk_fn_map[idx >> 5] |= 1U << (idx & 31);
+        }
     }
 }
 
@@ -172,45 +150,26 @@ int devs_vm_set_breakpoint(devs_ctx_t *ctx, unsigned pc, unsigned flags) {
     return 1;
 }
 
-static inline bool devs_vm_chk_brk(devs_ctx_t *ctx, devs_activation_t *frame) {
-    if (ctx->dbg_en) {
-        if (ctx->ignore_brk) {
-            ctx->ignore_brk = false;
-            return false;
-        }
+#if !DEVS_VM_THREADED
+// chk_brk is a constant in both callers below, so each gets its own copy
+static inline void exec_opcode_core(devs_ctx_t *ctx, devs_activation_t *frame, bool chk_brk) {
+    if (chk_brk && devs_vm_chk_brk(ctx, frame))
+        return;
 
-        devs_pc_t pc = frame->pc;
-        unsigned i = ctx->brk_jump_tbl[brk_hash(pc)];
-
-        if (i) {
-            devs_brk_t *l = ctx->brk_list;
-            for (--i; pc >= l[i].pc; ++i) {
-                if (pc == l[i].pc) {
-                    if (l[i].flags & DEVS_BRK_FLAG_STEP) {
-                        // DMESG("chk step %d %p %p", pc, frame, ctx->step_fn);
-                        if (frame == ctx->step_fn) {
-                            devs_vm_suspend(ctx, JD_DEVS_DBG_SUSPENSION_TYPE_STEP);
-                            return true;
-                        } else {
-                            continue;
-                        }
-                    } else {
-                        devs_vm_suspend(ctx, JD_DEVS_DBG_SUSPENSION_TYPE_BREAKPOINT);
-                        return true;
-                    }
-                }
-            }
-        }
+    uint8_t op;
+    const devs_vm_insn_t *insn = devs_vm_decoded_insn(ctx, frame);
+    if (insn) {
+        op = insn->op;
+        ctx->jmp_pc = frame->pc;
+        ctx->literal_int = insn->arg;
+        frame->pc += insn->size;
+    } else {
+        op = devs_vm_fetch_byte(frame, ctx);
     }
 
-    return false;
-}
-
-static void devs_vm_exec_opcode(devs_ctx_t *ctx, devs_activation_t *frame) {
-    if (devs_vm_chk_brk(ctx, frame))
-        return;
-
-    uint8_t op = devs_vm_fetch_byte(frame, ctx);
+#if DEVS_VM_OPSTATS
+    devs_vm_opstats_start(op);
+#endif
 
     if (op >= DEVS_DIRECT_CONST_OP) {
         int v = op - DEVS_DIRECT_CONST_OP - DEVS_DIRECT_CONST_OFFSET;
@@ -223,7 +182,7 @@ static void devs_vm_exec_opcode(devs_ctx_t *ctx, devs_activation_t *frame) {
     } else {
         uint8_t flags = DEVS_OP_PROPS[op];
 
-        if (flags & DEVS_BYTECODEFLAG_TAKES_NUMBER) {
+        if (!insn && (flags & DEVS_BYTECODEFLAG_TAKES_NUMBER)) {
             ctx->jmp_pc = frame->pc - 1;
             ctx->literal_int = devs_vm_fetch_int(frame, ctx);
         }
@@ -246,18 +205,136 @@ static void devs_vm_exec_opcode(devs_ctx_t *ctx, devs_activation_t *frame) {
     }
 }
 
-void devs_vm_exec_opcodes(devs_ctx_t *ctx) {
-    unsigned maxsteps = DEVS_MAX_STEPS;
+static void devs_vm_exec_opcode(devs_ctx_t *ctx, devs_activation_t *frame) {
+    exec_opcode_core(ctx, frame, false);
+}
+
+static void devs_vm_exec_opcode_brk(devs_ctx_t *ctx, devs_activation_t *frame) {
+    exec_opcode_core(ctx, frame, true);
+}
+
+#endif
+
+static unsigned exec_steps(devs_ctx_t *ctx, unsigned maxsteps) {
+#if DEVS_VM_THREADED
+    return devs_vm_exec_threaded(ctx, maxsteps);
+#else
+#if DEVS_VM_OPSTATS
+    devs_vm_opstats_break();
+#endif
+    devs_activation_t *frame;
+    while (ctx->curr_fn && maxsteps && !ctx->suspension) {
+        // the loop is only picked again when entering or leaving a function
+        const devs_function_desc_t *func = ctx->curr_fn->func;
+#if DEVS_VM_AOT
+        devs_aot_fn_t aot = ctx->dbg_en ? NULL : devs_vm_aot_lookup(ctx, func);
+        if (aot) {
+            maxsteps = aot(ctx, ctx->curr_fn, maxsteps);
+            continue;
+        }
+#endif
+#if DEVS_VM_JIT
+        devs_aot_fn_t jit = ctx->dbg_en ? NULL : devs_vm_jit_lookup(ctx, func);
+        if (jit) {
+            maxsteps = jit(ctx, ctx->curr_fn, maxsteps);
+            continue;
+        }
+        unsigned steps0 = maxsteps;
+#endif
+        if (ctx->dbg_en && devs_vm_func_has_brk(ctx, func)) {
+            while ((frame = ctx->curr_fn) && frame->func == func && --maxsteps &&
+                   !ctx->suspension) {
+                devs_vm_exec_opcode_brk(ctx, frame);
+#if DEVS_VM_OPSTATS
+                devs_vm_opstats_end();
+#endif
+            }
+        } else {
+            // nothing to ignore in this function
+            ctx->ignore_brk = false;
+            while ((frame = ctx->curr_fn) && frame->func == func && --maxsteps &&
+                   !ctx->suspension) {
+                devs_vm_exec_opcode(ctx, frame);
+#if DEVS_VM_OPSTATS
+                devs_vm_opstats_end();
+#endif
+            }
+        }
+#if DEVS_VM_JIT
+        devs_vm_jit_add_steps(ctx, func, steps0 - maxsteps);
+#endif
+    }
+    return maxsteps;
+#endif
+}
+
+static unsigned run_steps(devs_ctx_t *ctx, unsigned maxsteps) {
+#if DEVS_PROFILE_SIZE
+    devs_profile_t *prof = ctx->profile;
+    if (prof && prof->running) {
+        // sample every DEVS_PROFILE_INTERVAL steps counted across calls, so that fibers
+        // yielding before running that many steps are sampled too
+        while (maxsteps) {
+            unsigned chunk = maxsteps < prof->countdown ? maxsteps : prof->countdown;
+            unsigned left = exec_steps(ctx, chunk);
+            maxsteps -= chunk - left;
+            prof->countdown -= chunk - left;
+            if (prof->countdown == 0) {
+                devs_profile_sample(ctx);
+                prof->countdown = DEVS_PROFILE_INTERVAL;
+            }
+            if (left)
+                break;
+        }
+        return maxsteps;
+    }
+#endif
+    return exec_steps(ctx, maxsteps);
+}
+
+unsigned devs_vm_exec_opcodes(devs_ctx_t *ctx) {
+    unsigned maxsteps = DEVS_SLICE_STEPS;
+    unsigned steps;
+    bool stats = devs_get_global_flags() & DEVS_FLAG_VM_STATS;
+    uint64_t t0 = stats ? tim_get_micros() : 0;
 
     // halt applies on first instruction if nothing was running
     if (ctx->step_flags & DEVS_CTX_STEP_HALT)
         devs_vm_suspend(ctx, JD_DEVS_DBG_SUSPENSION_TYPE_HALT);
 
-    while (ctx->curr_fn && --maxsteps && !ctx->suspension)
-        devs_vm_exec_opcode(ctx, ctx->curr_fn);
+    maxsteps = run_steps(ctx, maxsteps);
+    steps = DEVS_SLICE_STEPS - maxsteps;
+
+    if (maxsteps == 0 && ctx->curr_fn && !ctx->suspension) {
+        // time slice is up; devs_fiber_preempt() is called at the next safe point
+        ctx->preempt_pending = 1;
+        maxsteps = run_steps(ctx, DEVS_MAX_STEPS);
+        steps += DEVS_MAX_STEPS - maxsteps;
+        ctx->preempt_pending = 0;
+        // no backward jump or call in DEVS_MAX_STEPS steps - shouldn't really happen
+        if (maxsteps == 0)
+            devs_panic(ctx, DEVS_PANIC_TIMEOUT);
+    }
+
+    if (stats) {
+        ctx->vm_stat_ops += steps;
+        ctx->vm_stat_us += tim_get_micros() - t0;
+    }
 
-    if (maxsteps == 0)
-        devs_panic(ctx, DEVS_PANIC_TIMEOUT);
+    return steps;
+}
+
+void devs_vm_dump_stats(devs_ctx_t *ctx) {
+#if DEVS_VM_OPSTATS
+    devs_vm_opstats_dump(false);
+#endif
+    devs_gc_dump_stats(ctx->gc);
+    if (!ctx->vm_stat_ops)
+        return;
+    DMESG("vm-stats: %s dispatch, %u ops in %u ms, %u ns/op",
+          DEVS_VM_THREADED ? "threaded" : "switch", (unsigned)ctx->vm_stat_ops,
+          (unsigned)(ctx->vm_stat_us / 1000),
+          (unsigned)(ctx->vm_stat_us * 1000 / ctx->vm_stat_ops));
 }
 
 bool devs_in_vm_loop(devs_ctx_t *ctx) {
@@ -75,6 +75,91 @@ static void stmt2_index_delete(devs_activation_t *frame, devs_ctx_t *ctx) {
         devs_value_unpin(ctx, idx);
 }
 
+// the value stack is empty at backward jumps and calls, so we can switch fibers there
+static inline void safe_point(devs_ctx_t *ctx) {
+    if (ctx->preempt_pending && ctx->curr_fn && !ctx->in_throw)
+        devs_fiber_preempt(ctx);
+}
+
+// Calls to static and bound builtin methods (Math.floor(), buf.getAt(), ...), which don't need
+// the generic path in devs_fiber_call_function(). Returns false for everything else, including
+// builtin constructors and bound functions wrapped in devs_bound_function_t.
+static inline bool call_builtin_fast(devs_ctx_t *ctx, unsigned N) {
+#if DEVS_VM_BUILTIN_FASTPATH
+    value_t *argp = ctx->the_stack;
+    value_t fn = argp[0];
+    value_t this_val;
+    uint32_t hv = devs_handle_value(fn);
+    int bltin;
+
+    switch (devs_handle_type(fn)) {
+    case DEVS_HANDLE_TYPE_STATIC_FUNCTION:
+        this_val = devs_undefined;
+        bltin = (int)hv - DEVS_FIRST_BUILTIN_FUNCTION;
+        break;
+    case DEVS_HANDLE_TYPE_BOUND_FUNCTION_STATIC:
+        this_val =
+            devs_value_from_handle(hv >> DEVS_PACK_SHIFT, hv & ((1 << DEVS_PACK_SHIFT) - 1));
+        bltin = (int)devs_handle_high_value(fn) - DEVS_FIRST_BUILTIN_FUNCTION;
+        break;
+    case DEVS_HANDLE_TYPE_BOUND_FUNCTION:
+        this_val = devs_value_from_handle(DEVS_HANDLE_TYPE_GC_OBJECT, hv);
+        bltin = (int)devs_handle_high_value(fn) - DEVS_FIRST_BUILTIN_FUNCTION;
+        break;
+    default:
+        return false;
+    }
+
+    if (bltin < 0)
+        return false;
+    JD_ASSERT(bltin < devs_num_builtin_functions);
+    const devs_builtin_function_t *h = &devs_builtin_functions[bltin];
+    if (h->flags & DEVS_BUILTIN_FLAG_IS_CTOR)
+        return false;
+    JD_ASSERT(!(h->flags & DEVS_BUILTIN_FLAG_IS_PROPERTY));
+
+    argp[0] = this_val;
+    if (N < h->num_args)
+        memset(argp + 1 + N, 0, (h->num_args - N) * sizeof(value_t));
+    ctx->curr_fiber->ret_val = devs_undefined;
+    h->handler.meth(ctx);
+    return true;
+#else
+    return false;
+#endif
+}
+
+// `return f(...)` outside of try blocks compiles to CALLn, RET_VAL, RETURN.
+// The current frame can be dropped before the call when nothing else needs it.
+static bool tail_call_ok(devs_activation_t *frame, devs_ctx_t *ctx) {
+#if DEVS_VM_TAIL_CALLS
+    unsigned pc = frame->pc;
+    if (pc + 2 > frame->maxpc || ctx->img.data[pc] != DEVS_EXPR0_RET_VAL ||
+        ctx->img.data[pc + 1] != DEVS_STMT1_RETURN)
+        return false;
+
+    // the bottom frame decides when the fiber ends; ctors return `this`;
+    // the debugger wants to see all frames
+    if (!frame->caller || (frame->func->flags & DEVS_FUNCTIONFLAG_IS_CTOR) || ctx->dbg_en)
+        return false;
+
+    // only plain bytecode functions; anything else may throw, which should happen in this frame
+    value_t fn = ctx->the_stack[0];
+    switch (devs_handle_type(fn)) {
+    case DEVS_HANDLE_TYPE_STATIC_FUNCTION:
+        return devs_handle_value(fn) < DEVS_FIRST_BUILTIN_FUNCTION;
+    case DEVS_HANDLE_TYPE_CLOSURE:
+    case DEVS_HANDLE_TYPE_BOUND_FUNCTION:
+    case DEVS_HANDLE_TYPE_BOUND_FUNCTION_STATIC:
+        return devs_handle_high_value(fn) < DEVS_FIRST_BUILTIN_FUNCTION;
+    default:
+        return false;
+    }
+#else
+    return false;
+#endif
+}
+
 static void stmt_callN(devs_activation_t *frame, devs_ctx_t *ctx, unsigned N) {
     JD_ASSERT(ctx->stack_top == N + 1);
     ctx->stack_top = 0;
@@ -82,7 +167,13 @@ static void stmt_callN(devs_activation_t *frame, devs_ctx_t *ctx, unsigned N) {
     devs_log_value(ctx, "fn", ctx->the_stack[0]);
     devs_log_value(ctx, "a0", ctx->the_stack[1]);
 #endif
-    devs_fiber_call_function(ctx->curr_fiber, N, NULL);
+    if (call_builtin_fast(ctx, N))
+        ; // done
+    else if (tail_call_ok(frame, ctx))
+        devs_fiber_tail_call(ctx->curr_fiber, N);
+    else
+        devs_fiber_call_function(ctx->curr_fiber, N, NULL);
+    safe_point(ctx);
 }
 
 #define STMT_CALL(n, k)                                                                            \
@@ -110,6 +201,7 @@ static void stmt2_call_array(devs_activation_t *frame, devs_ctx_t *ctx) {
         JD_ASSERT(ctx->stack_top == 0); // fn needs to be at stack top
         ctx->stack_top_for_gc = 1;
         devs_fiber_call_function(ctx->curr_fiber, 0, devs_value_to_gc_obj(ctx, args));
+        safe_point(ctx);
     }
 }
 static int get_pc(devs_activation_t *frame, devs_ctx_t *ctx) {
@@ -125,15 +217,21 @@ static int get_pc(devs_activation_t *frame, devs_ctx_t *ctx) {
 
 static void stmtx_jmp(devs_activation_t *frame, devs_ctx_t *ctx) {
     int pc = get_pc(frame, ctx);
-    if (pc)
+    if (pc) {
         frame->pc = pc;
+        if (pc <= ctx->jmp_pc)
+            safe_point(ctx);
+    }
 }
 
 static void stmtx1_jmp_z(devs_activation_t *frame, devs_ctx_t *ctx) {
     int cond = devs_value_to_bool(ctx, devs_vm_pop_arg(ctx));
     int pc = get_pc(frame, ctx);
-    if (pc && !cond)
+    if (pc && !cond) {
         frame->pc = pc;
+        if (pc <= ctx->jmp_pc)
+            safe_point(ctx);
+    }
 }
 
 static void stmtx_jmp_ret_val_z(devs_activation_t *frame, devs_ctx_t *ctx) {
@@ -404,16 +502,13 @@ static value_t static_something(devs_ctx_t *ctx, unsigned tp) {
     return r;
 }
 
-static inline value_t get_field_ex(devs_ctx_t *ctx, unsigned tp, value_t obj) {
+static inline value_t get_field(devs_ctx_t *ctx, unsigned tp) {
+    value_t obj = devs_vm_pop_arg(ctx);
     value_t fld = static_something(ctx, tp);
     if (devs_is_undefined(fld))
         return devs_undefined;
     else
-        return devs_object_get(ctx, obj, fld);
-}
-
-static inline value_t get_field(devs_ctx_t *ctx, unsigned tp) {
-    return get_field_ex(ctx, tp, devs_vm_pop_arg(ctx));
+        return devs_object_get_cached(ctx, obj, fld, ctx->jmp_pc);
 }
 
 static value_t exprx_static_buffer(devs_activation_t *frame, devs_ctx_t *ctx) {
@@ -613,15 +708,37 @@ static value_t expr1_to_bool(devs_activation_t *frame, devs_ctx_t *ctx) {
     return devs_value_from_bool(devs_value_to_bool(ctx, v));
 }
 
-static int exec2_and_check_int(devs_activation_t *frame, devs_ctx_t *ctx) {
+// Fast path for binary operators: if both operands on the stack are tagged ints, pop them
+// into a/b and return true; otherwise leave the stack alone for the generic path.
+static inline bool exec2_int_fast(devs_ctx_t *ctx, int32_t *a, int32_t *b) {
+#if !DEVS_VM_INT_FASTPATH
+    return false;
+#endif
+    unsigned top = ctx->stack_top;
+    if (top < 2)
+        return false;
+    const value_t *args = &ctx->the_stack[top - 2];
+    if (!devs_is_tagged_int(args[0]) || !devs_is_tagged_int(args[1]))
+        return false;
+    *a = args[0].val_int32;
+    *b = args[1].val_int32;
+    ctx->stack_top = top - 2;
+    return true;
+}
+
+// result of an overflowing int32 op is finite and outside of int32 range,
+// so it's already in canonical form and doesn't need devs_value_from_double()
+static inline value_t int_overflow_result(double v) {
+    value_t r;
+    r._f = v;
+    return r;
+}
+
+static void exec2(devs_activation_t *frame, devs_ctx_t *ctx) {
     ctx->binop[1] = devs_vm_pop_arg(ctx);
     ctx->binop[0] = devs_vm_pop_arg(ctx);
-    return devs_is_tagged_int(ctx->binop[0]) && devs_is_tagged_int(ctx->binop[1]);
 }
 
-#define aa ctx->binop[0].val_int32
-#define bb ctx->binop[1].val_int32
-
 #define af ctx->binop_f[0]
 #define bf ctx->binop_f[1]
 
@@ -629,134 +746,255 @@ static bool either_is_string(devs_ctx_t *ctx) {
     return devs_is_string(ctx, ctx->binop[0]) || devs_is_string(ctx, ctx->binop[1]);
 }
 
-static void force_double(devs_ctx_t *ctx) {
+static void exec2_and_force_double(devs_activation_t *frame, devs_ctx_t *ctx) {
+    exec2(frame, ctx);
     af = devs_value_to_double(ctx, ctx->binop[0]);
     bf = devs_value_to_double(ctx, ctx->binop[1]);
 }
 
-static void exec2_and_force_int(devs_activation_t *frame, devs_ctx_t *ctx) {
-    bb = devs_vm_pop_arg_i32(ctx);
-    aa = devs_vm_pop_arg_i32(ctx);
-}
-
-static int exec2_and_check_int_or_force_double(devs_activation_t *frame, devs_ctx_t *ctx) {
-    if (exec2_and_check_int(frame, ctx))
-        return 1;
-    force_double(ctx);
-    return 0;
+static inline void exec2_and_force_int(devs_activation_t *frame, devs_ctx_t *ctx, int32_t *a,
+                                       int32_t *b) {
+    if (exec2_int_fast(ctx, a, b))
+        return;
+    *b = devs_vm_pop_arg_i32(ctx);
+    *a = devs_vm_pop_arg_i32(ctx);
 }
 
 static value_t expr2_add(devs_activation_t *frame, devs_ctx_t *ctx) {
-    if (exec2_and_check_int(frame, ctx)) {
-        int r;
-        if (!__builtin_sadd_overflow(aa, bb, &r))
-            return devs_value_from_int(r);
+    int32_t a, b, r;
+    if (exec2_int_fast(ctx, &a, &b)) {
+        if (__builtin_sadd_overflow(a, b, &r))
+            return int_overflow_result((double)a + b);
+        return devs_value_from_i32(r);
     }
+    exec2(frame, ctx);
     if (either_is_string(ctx))
         return devs_string_concat(ctx, ctx->binop[0], ctx->binop[1]);
-    force_double(ctx);
+    af = devs_value_to_double(ctx, ctx->binop[0]);
+    bf = devs_value_to_double(ctx, ctx->binop[1]);
     return devs_value_from_double(af + bf);
 }
 
 static value_t expr2_sub(devs_activation_t *frame, devs_ctx_t *ctx) {
-    if (exec2_and_check_int(frame, ctx)) {
-        int r;
-        if (!__builtin_ssub_overflow(aa, bb, &r))
-            return devs_value_from_int(r);
+    int32_t a, b, r;
+    if (exec2_int_fast(ctx, &a, &b)) {
+        if (__builtin_ssub_overflow(a, b, &r))
+            return int_overflow_result((double)a - b);
+        return devs_value_from_i32(r);
     }
-    force_double(ctx);
+    exec2_and_force_double(frame, ctx);
     return devs_value_from_double(af - bf);
 }
 
 static value_t expr2_mul(devs_activation_t *frame, devs_ctx_t *ctx) {
-    if (exec2_and_check_int(frame, ctx)) {
-        int r;
-        if (!__builtin_smul_overflow(aa, bb, &r))
-            return devs_value_from_int(r);
+    int32_t a, b, r;
+    if (exec2_int_fast(ctx, &a, &b)) {
+        if (__builtin_smul_overflow(a, b, &r))
+            return int_overflow_result((double)a * b);
+        return devs_value_from_i32(r);
     }
-    force_double(ctx);
+    exec2_and_force_double(frame, ctx);
     return devs_value_from_double(af * bf);
 }
 
 static value_t expr2_div(devs_activation_t *frame, devs_ctx_t *ctx) {
-    if (exec2_and_check_int(frame, ctx)) {
-        int r;
+    int32_t a, b, r;
+    if (exec2_int_fast(ctx, &a, &b)) {
         // not sure this is worth it on M0+; it definitely is on M4
-        if (bb != 0 && (bb != -1 || aa != INT_MIN) && ((r = aa / bb)) * bb == aa)
-            return devs_value_from_int(r);
+        if (b != 0 && (b != -1 || a != INT_MIN) && ((r = a / b)) * b == a)
+            return devs_value_from_i32(r);
+        // division by zero needs NaN/Inf handling
+        return devs_value_from_double((double)a / b);
     }
-    force_double(ctx);
+    exec2_and_force_double(frame, ctx);
     return devs_value_from_double(af / bf);
 }
 
 static value_t expr2_bit_and(devs_activation_t *frame, devs_ctx_t *ctx) {
-    exec2_and_force_int(frame, ctx);
-    return devs_value_from_int(aa & bb);
+    int32_t a, b;
+    exec2_and_force_int(frame, ctx, &a, &b);
+    return devs_value_from_i32(a & b);
 }
 
 static value_t expr2_bit_or(devs_activation_t *frame, devs_ctx_t *ctx) {
-    exec2_and_force_int(frame, ctx);
-    return devs_value_from_int(aa | bb);
+    int32_t a, b;
+    exec2_and_force_int(frame, ctx, &a, &b);
+    return devs_value_from_i32(a | b);
 }
 
 static value_t expr2_bit_xor(devs_activation_t *frame, devs_ctx_t *ctx) {
-    exec2_and_force_int(frame, ctx);
-    return devs_value_from_int(aa ^ bb);
+    int32_t a, b;
+    exec2_and_force_int(frame, ctx, &a, &b);
+    return devs_value_from_i32(a ^ b);
 }
 
 static value_t expr2_shift_left(devs_activation_t *frame, devs_ctx_t *ctx) {
-    exec2_and_force_int(frame, ctx);
-    return devs_value_from_int(aa << (31 & bb));
+    int32_t a, b;
+    exec2_and_force_int(frame, ctx, &a, &b);
+    return devs_value_from_i32((uint32_t)a << (31 & b));
 }
 
 static value_t expr2_shift_right(devs_activation_t *frame, devs_ctx_t *ctx) {
-    exec2_and_force_int(frame, ctx);
-    return devs_value_from_int(aa >> (31 & bb));
+    int32_t a, b;
+    exec2_and_force_int(frame, ctx, &a, &b);
+    return devs_value_from_i32(a >> (31 & b));
 }
 
 static value_t expr2_shift_right_unsigned(devs_activation_t *frame, devs_ctx_t *ctx) {
-    exec2_and_force_int(frame, ctx);
-    uint32_t tmp = (uint32_t)aa >> (31 & bb);
+    int32_t a, b;
+    exec2_and_force_int(frame, ctx, &a, &b);
+    uint32_t tmp = (uint32_t)a >> (31 & b);
     if (tmp >> 31)
-        return devs_value_from_double(tmp);
+        return int_overflow_result(tmp);
     else
-        return devs_value_from_int(tmp);
+        return devs_value_from_i32(tmp);
 }
 
 static value_t expr2_eq(devs_activation_t *frame, devs_ctx_t *ctx) {
-    if (exec2_and_check_int(frame, ctx))
-        return devs_value_from_bool(aa == bb);
+    int32_t a, b;
+    if (exec2_int_fast(ctx, &a, &b))
+        return devs_value_from_bool(a == b);
+    exec2(frame, ctx);
     return devs_value_from_bool(devs_value_ieee_eq(ctx, ctx->binop[0], ctx->binop[1]));
 }
 
 static value_t expr2_ne(devs_activation_t *frame, devs_ctx_t *ctx) {
-    if (exec2_and_check_int(frame, ctx))
-        return devs_value_from_bool(aa != bb);
+    int32_t a, b;
+    if (exec2_int_fast(ctx, &a, &b))
+        return devs_value_from_bool(a != b);
+    exec2(frame, ctx);
     return devs_value_from_bool(!devs_value_ieee_eq(ctx, ctx->binop[0], ctx->binop[1]));
 }
 
 static value_t expr2_approx_eq(devs_activation_t *frame, devs_ctx_t *ctx) {
-    if (exec2_and_check_int(frame, ctx))
-        return devs_value_from_bool(aa == bb);
+    int32_t a, b;
+    if (exec2_int_fast(ctx, &a, &b))
+        return devs_value_from_bool(a == b);
+    exec2(frame, ctx);
     return devs_value_from_bool(devs_value_approx_eq(ctx, ctx->binop[0], ctx->binop[1]));
 }
 
 static value_t expr2_approx_ne(devs_activation_t *frame, devs_ctx_t *ctx) {
-    if (exec2_and_check_int(frame, ctx))
-        return devs_value_from_bool(aa != bb);
+    int32_t a, b;
+    if (exec2_int_fast(ctx, &a, &b))
+        return devs_value_from_bool(a != b);
+    exec2(frame, ctx);
     return devs_value_from_bool(!devs_value_approx_eq(ctx, ctx->binop[0], ctx->binop[1]));
 }
 
 static value_t expr2_le(devs_activation_t *frame, devs_ctx_t *ctx) {
-    if (exec2_and_check_int_or_force_double(frame, ctx))
-        return devs_value_from_bool(aa <= bb);
+    int32_t a, b;
+    if (exec2_int_fast(ctx, &a, &b))
+        return devs_value_from_bool(a <= b);
+    exec2_and_force_double(frame, ctx);
     return devs_value_from_bool(af <= bf);
 }
 
 static value_t expr2_lt(devs_activation_t *frame, devs_ctx_t *ctx) {
-    if (exec2_and_check_int_or_force_double(frame, ctx))
-        return devs_value_from_bool(aa < bb);
+    int32_t a, b;
+    if (exec2_int_fast(ctx, &a, &b))
+        return devs_value_from_bool(a < b);
+    exec2_and_force_double(frame, ctx);
     return devs_value_from_bool(af < bf);
 }
 
 const void *const devs_vm_op_handlers[DEVS_OP_PAST_LAST + 1] = {DEVS_OP_HANDLERS};
+
+#if DEVS_VM_THREADED
+
+static inline void run_stmt(devs_vm_stmt_handler_t fn, devs_activation_t *frame, devs_ctx_t *ctx) {
+    fn(frame, ctx);
+    if (ctx->stack_top)
+        devs_invalid_program(ctx, 60103);
+}
+
+static inline void run_expr(devs_vm_expr_handler_t fn, devs_activation_t *frame, devs_ctx_t *ctx) {
+    value_t v = fn(frame, ctx);
+    devs_vm_push(ctx, v);
+}
+
+// handlers are called directly, so the compiler can inline them into their opcode body
+#define RUN_HANDLER(fn)                                                                            \
+    _Generic((fn), devs_vm_stmt_handler_t: run_stmt, devs_vm_expr_handler_t: run_expr)(fn, frame, \
+                                                                                       ctx)
+
+// same conditions as the loop in devs_vm_exec_opcodes(), replicated at the end of every opcode
+#define DISPATCH()                                                                                 \
+    do {                                                                                           \
+        if (!ctx->curr_fn || !--maxsteps || ctx->suspension)                                       \
+            return maxsteps;                                                                       \
+        frame = ctx->curr_fn;                                                                      \
+        if (ctx->dbg_en)                                                                           \
+            goto check_brk;                                                                        \
+        insn = devs_vm_decoded_insn(ctx, frame);                                                   \
+        if (insn) {                                                                                \
+            op = insn->op;                                                                         \
+            ctx->jmp_pc = frame->pc;                                                               \
+            ctx->literal_int = insn->arg;                                                          \
+            frame->pc += insn->size;                                                               \
+            goto *decoded_labels[op];                                                              \
+        }                                                                                          \
+        op = devs_vm_fetch_byte(frame, ctx);                                                       \
+        goto *labels[op];                                                                          \
+    } while (0)
+
+#define OP_LABEL(code, fn) [code] = &&op_##code,
+#define OP_DECODED_LABEL(code, fn) [code] = &&decoded_op_##code,
+
+#define OP_BODY(code, fn)                                                                          \
+    op_##code : if (DEVS_OP_PROPS[code] & DEVS_BYTECODEFLAG_TAKES_NUMBER) {                        \
+        ctx->jmp_pc = frame->pc - 1;                                                               \
+        ctx->literal_int = devs_vm_fetch_int(frame, ctx);                                          \
+    }                                                                                              \
+    decoded_op_##code : ctx->stack_top_for_gc = ctx->stack_top;                                    \
+    RUN_HANDLER(fn);                                                                               \
+    if (ctx->in_throw)                                                                             \
+        devs_process_throw(ctx);                                                                   \
+    DISPATCH();
+
+unsigned devs_vm_exec_threaded(devs_ctx_t *ctx, unsigned maxsteps) {
+    static const void *const labels[256] = {
+        DEVS_OP_DISPATCH(OP_LABEL)
+        [DEVS_OP_PAST_LAST ... DEVS_DIRECT_CONST_OP - 1] = &&op_invalid,
+        [DEVS_DIRECT_CONST_OP ... 0xff] = &&op_direct_const,
+    };
+    // pre-decoded instructions skip operand parsing; they are never invalid
+    static const void *const decoded_labels[256] = {
+        DEVS_OP_DISPATCH(OP_DECODED_LABEL)
+        [DEVS_OP_PAST_LAST ... DEVS_DIRECT_CONST_OP - 1] = &&op_invalid,
+        [DEVS_DIRECT_CONST_OP ... 0xff] = &&op_direct_const,
+    };
+
+    devs_activation_t *frame;
+    const devs_vm_insn_t *insn;
+    uint8_t op;
+    const devs_function_desc_t *brk_func = NULL;
+    bool brk_en = false;
+
+    DISPATCH();
+
+check_brk:
+    // only functions with breakpoints pay for devs_vm_chk_brk()
+    if (frame->func != brk_func) {
+        brk_func = frame->func;
+        brk_en = devs_vm_func_has_brk(ctx, brk_func);
+        if (!brk_en)
+            ctx->ignore_brk = false;
+    }
+    if (brk_en && devs_vm_chk_brk(ctx, frame))
+        DISPATCH();
+    op = devs_vm_fetch_byte(frame, ctx);
+    goto *labels[op];
+
+op_direct_const:
+    devs_vm_push(ctx, devs_value_from_int(op - DEVS_DIRECT_CONST_OP - DEVS_DIRECT_CONST_OFFSET));
+    DISPATCH();
+
+op_invalid:
+    devs_invalid_program(ctx, 60102);
+    DISPATCH();
+
+    DEVS_OP_DISPATCH(OP_BODY)
+}
+
+#endif
@@ -0,0 +1,121 @@
+#include "devs_internal.h"
+#include "devs_vm_internal.h"
+
+#if DEVS_VM_OPSTATS
+
+#if JD_HOSTED
+#include <time.h>
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#else
+static uint64_t now_ns(void) {
+    return 0;
+}
+#endif
+
+// all direct constant opcodes share the last slot
+#define NUM_SLOTS (DEVS_OP_PAST_LAST + 1)
+#define NO_OP 0xff
+
+static uint64_t op_count[NUM_SLOTS];
+static uint64_t op_ns[NUM_SLOTS];
+static uint32_t pair_count[NUM_SLOTS][NUM_SLOTS];
+static uint8_t prev_op = NO_OP;
+static uint8_t curr_op = NO_OP;
+static uint64_t op_start;
+
+#define OP_NAME(code, fn) [code] = #fn,
+static const char *const op_names[NUM_SLOTS] = {DEVS_OP_DISPATCH(OP_NAME)};
+
+static const char *op_name(unsigned slot) {
+    if (slot == DEVS_OP_PAST_LAST)
+        return "direct_const";
+    return op_names[slot] ? op_names[slot] : "???";
+}
+
+void devs_vm_opstats_start(unsigned op) {
+    uint8_t slot = op >= DEVS_OP_PAST_LAST ? DEVS_OP_PAST_LAST : op;
+    op_count[slot]++;
+    if (prev_op != NO_OP)
+        pair_count[prev_op][slot]++;
+    prev_op = curr_op = slot;
+    op_start = now_ns();
+}
+
+void devs_vm_opstats_end(void) {
+    if (curr_op != NO_OP) {
+        op_ns[curr_op] += now_ns() - op_start;
+        curr_op = NO_OP;
+    }
+}
+
+void devs_vm_opstats_break(void) {
+    prev_op = NO_OP;
+}
+
+void devs_vm_opstats_reset(void) {
+    memset(op_count, 0, sizeof(op_count));
+    memset(op_ns, 0, sizeof(op_ns));
+    memset(pair_count, 0, sizeof(pair_count));
+    prev_op = curr_op = NO_OP;
+}
+
+void devs_vm_opstats_dump(bool reset) {
+    uint64_t total = 0, total_ns = 0;
+    for (unsigned i = 0; i < NUM_SLOTS; ++i) {
+        total += op_count[i];
+        total_ns += op_ns[i];
+    }
+    if (!total)
+        return;
+
+    DMESG("opstats: %u ops, %u us", (unsigned)total, (unsigned)(total_ns / 1000));
+
+    bool done[NUM_SLOTS] = {0};
+    for (unsigned k = 0; k < 30; ++k) {
+        int best = -1;
+        for (unsigned i = 0; i < NUM_SLOTS; ++i)
+            if (!done[i] && op_count[i] && (best < 0 || op_count[i] > op_count[best]))
+                best = i;
+        if (best < 0)
+            break;
+        done[best] = true;
+        DMESG("opstats: %s %u (%u%%) %u ns/op", op_name(best), (unsigned)op_count[best],
+              (unsigned)(op_count[best] * 100 / total), (unsigned)(op_ns[best] / op_count[best]));
+    }
+
+    // top pairs by (count, position), each strictly below the previous one
+    uint64_t last_cnt = UINT64_MAX;
+    unsigned last_pos = 0;
+    for (unsigned k = 0; k < 20; ++k) {
+        uint32_t best_cnt = 0;
+        unsigned best_pos = 0;
+        for (unsigned pos = 0; pos < NUM_SLOTS * NUM_SLOTS; ++pos) {
+            uint32_t c = pair_count[pos / NUM_SLOTS][pos % NUM_SLOTS];
+            if ((c < last_cnt || (c == last_cnt && pos > last_pos)) &&
+                (c > best_cnt || (c == best_cnt && pos < best_pos))) {
+                best_cnt = c;
+                best_pos = pos;
+            }
+        }
+        if (!best_cnt)
+            break;
+        DMESG("opstats: pair %s, %s: %u", op_name(best_pos / NUM_SLOTS),
+              op_name(best_pos % NUM_SLOTS), (unsigned)best_cnt);
+        last_cnt = best_cnt;
+        last_pos = best_pos;
+    }
+
+    if (reset)
+        devs_vm_opstats_reset();
+}
+
+#else
+
+void devs_vm_opstats_reset(void) {}
+void devs_vm_opstats_dump(bool reset) {}
+
+#endif
@@ -0,0 +1,157 @@
+// Ahead-of-time translation of a .devs image to C; see `make aot` in the Makefile.
+//
+// Every function becomes a C function with a case for every instruction, which runs the
+// same handlers as the interpreter (the generated file includes vm_ops.c, so they can be inlined).
+// Operands are decoded at translation time. Step counting, the curr_fn and suspension checks
+// and exception processing are the same as in exec_steps(), so calls, returns, throws,
+// fiber yields and preemption just leave the generated function, to be re-entered at frame->pc.
+// Jumps re-dispatch on frame->pc.
+
+#include <stdio.h>
+
+#include "devs_internal.h"
+#include "devs_vm_internal.h"
+
+#define OP_NAME(code, fn) [code] = #fn,
+static const char *const op_names[DEVS_OP_PAST_LAST] = {DEVS_OP_DISPATCH(OP_NAME)};
+
+static const char prelude[] = //
+    "#include \"vm_ops.c\"\n"
+    "\n"
+    "#define AOT_OP(pc_, next_)                                                              \\\n"
+    "    case pc_:                                                                           \\\n"
+    "        if (!--maxsteps || ctx->suspension)                                             \\\n"
+    "            return maxsteps;                                                            \\\n"
+    "        frame->pc = next_;\n"
+    "#define AOT_ARG(pc_, arg_)                                                              \\\n"
+    "    ctx->jmp_pc = pc_;                                                                  \\\n"
+    "    ctx->literal_int = arg_;\n"
+    "#define AOT_STMT(fn)                                                                    \\\n"
+    "    ctx->stack_top_for_gc = ctx->stack_top;                                             \\\n"
+    "    fn(frame, ctx);                                                                     \\\n"
+    "    if (ctx->stack_top)                                                                 \\\n"
+    "        devs_invalid_program(ctx, 60103);\n"
+    "#define AOT_EXPR(fn)                                                                    \\\n"
+    "    ctx->stack_top_for_gc = ctx->stack_top;                                             \\\n"
+    "    devs_vm_push(ctx, fn(frame, ctx));\n"
+    "#define AOT_CONST(v) devs_vm_push(ctx, devs_value_from_int(v));\n"
+    "#define AOT_END(next_)                                                                  \\\n"
+    "    if (ctx->in_throw)                                                                  \\\n"
+    "        devs_process_throw(ctx);                                                        \\\n"
+    "    if (ctx->curr_fn != frame || frame->pc != next_)                                    \\\n"
+    "        continue;                                                                       \\\n"
+    "    __attribute__((fallthrough));\n"
+    "#define AOT_FAIL(pc_, code)                                                             \\\n"
+    "    case pc_:                                                                           \\\n"
+    "        if (!--maxsteps || ctx->suspension)                                             \\\n"
+    "            return maxsteps;                                                            \\\n"
+    "        devs_invalid_program(ctx, code);                                                \\\n"
+    "        return maxsteps;\n"
+    "\n";
+
+// same encoding as devs_vm_fetch_int()
+static int decode_int(const uint8_t *code, unsigned *pc, unsigned end, int32_t *res) {
+    if (*pc >= end)
+        return -1;
+    uint8_t v = code[(*pc)++];
+    if (v < DEVS_FIRST_MULTIBYTE_INT) {
+        *res = v;
+        return 0;
+    }
+    bool n = !!(v & 4);
+    int len = (v & 3) + 1;
+    int32_t r = 0;
+    for (int i = 0; i < len; ++i) {
+        if (*pc >= end)
+            return -1;
+        r <<= 8;
+        r |= code[(*pc)++];
+    }
+    *res = n ? -r : r;
+    return 0;
+}
+
+static void write_function(FILE *f, devs_img_t img, unsigned fidx) {
+    const devs_function_desc_t *func = devs_img_get_function(img, fidx);
+    const uint8_t *code = img.data;
+    unsigned end = func->start + func->length;
+
+    fprintf(f, "// %s\n", devs_img_fun_name(img, fidx));
+    fprintf(f,
+            "static unsigned aot_F%u(devs_ctx_t *ctx, devs_activation_t *frame, unsigned maxsteps) "
+            "{\n",
+            fidx);
+    // jumps, calls etc. continue the loop
+    fprintf(f, "    for (;;) {\n");
+    fprintf(f, "        if (ctx->curr_fn != frame)\n            return maxsteps;\n");
+    fprintf(f, "        switch (frame->pc) {\n");
+
+    unsigned pc = func->start;
+    while (pc < end) {
+        unsigned op_pc = pc;
+        uint8_t op = code[pc++];
+
+        if (op >= DEVS_DIRECT_CONST_OP) {
+            fprintf(f, "            AOT_OP(%u, %u) AOT_CONST(%d) AOT_END(%u)\n", op_pc, pc,
+                    op - DEVS_DIRECT_CONST_OP - DEVS_DIRECT_CONST_OFFSET, pc);
+            continue;
+        }
+
+        if (op >= DEVS_OP_PAST_LAST) {
+            fprintf(f, "            AOT_FAIL(%u, 60102)\n", op_pc);
+            continue;
+        }
+
+        uint8_t flags = DEVS_OP_PROPS[op];
+        int32_t arg = 0;
+        if ((flags & DEVS_BYTECODEFLAG_TAKES_NUMBER) && decode_int(code, &pc, end, &arg) != 0) {
+            // operand runs past the end of the function
+            fprintf(f, "            AOT_FAIL(%u, 60100)\n", op_pc);
+            break;
+        }
+
+        fprintf(f, "            AOT_OP(%u, %u) ", op_pc, pc);
+        if (flags & DEVS_BYTECODEFLAG_TAKES_NUMBER)
+            fprintf(f, "AOT_ARG(%u, %d) ", op_pc, (int)arg);
+        fprintf(f, "%s(%s) AOT_END(%u)\n",
+                flags & DEVS_BYTECODEFLAG_IS_STMT ? "AOT_STMT" : "AOT_EXPR", op_names[op], pc);
+    }
+
+    // falling off the end of the function
+    if (pc == end)
+        fprintf(f, "            AOT_FAIL(%u, 60100)\n", end);
+    fprintf(f, "        default:\n");
+    fprintf(f, "            // not at instruction boundary\n");
+    fprintf(f, "            devs_invalid_program(ctx, 60132);\n");
+    fprintf(f, "            return maxsteps;\n");
+    fprintf(f, "        }\n");
+    fprintf(f, "    }\n");
+    fprintf(f, "}\n\n");
+}
+
+int devs_aot_write_c(const uint8_t *imgdata, uint32_t size, FILE *f) {
+    if (devs_verify(imgdata, size) != 0)
+        return -1;
+
+    devs_img_t img;
+    img.data = imgdata;
+    unsigned num_fn = devs_img_num_functions(img);
+
+    fprintf(f, "// generated by jdcli -A; do not edit\n");
+    fprintf(f, "%s", prelude);
+
+    for (unsigned i = 0; i < num_fn; ++i)
+        write_function(f, img, i);
+
+    fprintf(f, "static const devs_aot_fn_t aot_functions[] = {\n");
+    for (unsigned i = 0; i < num_fn; ++i)
+        fprintf(f, "    aot_F%u,\n", i);
+    fprintf(f, "};\n\n");
+    fprintf(f, "static const devs_aot_image_t aot_image = {0x%08x, %u, aot_functions};\n\n",
+            (unsigned)devs_aot_image_hash(imgdata), num_fn);
+    fprintf(f, "const devs_aot_image_t *devs_aot_get_image(void) {\n"
+               "    return &aot_image;\n"
+               "}\n");
+
+    return 0;
+}
@@ -5,6 +5,7 @@
 #include <errno.h>
 #include <pthread.h>
 #include <assert.h>
+#include <signal.h>
 
 #include "jd_sdk.h"
 #include "devicescript.h"
@@ -18,6 +19,7 @@ extern uint64_t cached_devid;
 
 static bool test_mode;
 static bool remote_deploy;
+static const char *profile_file;
 
 static void frame_cb(void *userdata, jd_frame_t *frame) {
     jd_rx_frame_received_loopback(frame);
@@ -76,6 +78,25 @@ void devs_panic_handler(int exitcode) {
 }
 #endif
 
+#ifndef __EMSCRIPTEN__
+static void write_profile_line(void *userdata, const char *line) {
+    fprintf(userdata, "%s\n", line);
+}
+
+void devs_profile_handler(devs_ctx_t *ctx) {
+    if (!profile_file)
+        return;
+    FILE *f = fopen(profile_file, "w");
+    if (!f) {
+        perror(profile_file);
+        return;
+    }
+    devs_profile_write_collapsed(ctx, write_profile_line, f);
+    fclose(f);
+    LOG("profile written to %s", profile_file);
+}
+#endif
+
 static void client_event_handler(void *dummy, int event_id, void *arg0, void *arg1) {
     jd_device_t *dev = arg0;
     // jd_register_query_t *reg = arg1;
@@ -134,17 +155,18 @@ int devs_client_deploy(const void *img, unsigned imgsize) {
     return 0;
 }
 
-int load_image(const char *name) {
+static uint8_t *read_image(const char *name, uint32_t *psize) {
     FILE *f = name ? fopen(name, "rb") : NULL;
     if (!f) {
         fprintf(stderr, "can't open image '%s'\n", name);
-        return -1;
+        return NULL;
     }
     fseek(f, 0, SEEK_END);
     long size = ftell(f);
     if (size <= 0) {
         fprintf(stderr, "can't determine file size for` '%s'\n", name);
-        return -2;
+        fclose(f);
+        return NULL;
     }
     fseek(f, 0, SEEK_SET);
     uint8_t *img = jd_alloc(size + 1);
@@ -152,6 +174,15 @@ int load_image(const char *name) {
     fclose(f);
     if (memcmp("4a6163530a", img, 10) == 0)
         size = jd_from_hex(img, (const char *)img);
+    *psize = size;
+    return img;
+}
+
+int load_image(const char *name) {
+    uint32_t size;
+    uint8_t *img = read_image(name, &size);
+    if (!img)
+        return -1;
     int r = devs_verify(img, size);
     if (r) {
         fprintf(stderr, "verification error for '%s': %d\n", name, r);
@@ -175,6 +206,31 @@ int load_image(const char *name) {
     return 0;
 }
 
+#ifndef __EMSCRIPTEN__
+int devs_aot_write_c(const uint8_t *imgdata, uint32_t size, FILE *f);
+
+static int write_aot(const char *name, const char *out) {
+    uint32_t size;
+    uint8_t *img = read_image(name, &size);
+    if (!img)
+        return 1;
+    FILE *f = fopen(out, "w");
+    if (!f) {
+        perror(out);
+        jd_free(img);
+        return 1;
+    }
+    int r = devs_aot_write_c(img, size, f);
+    fclose(f);
+    jd_free(img);
+    if (r) {
+        fprintf(stderr, "verification error for '%s'\n", name);
+        return 1;
+    }
+    return 0;
+}
+#endif
+
 #ifndef __EMSCRIPTEN__
 void app_print_dmesg(const char *ptr) {
     printf("    %s\n", ptr);
@@ -217,6 +273,20 @@ static void client_process(void) {
     target_wait_us(jd_max_sleep);
 }
 
+// kill -USR1 dumps and resets opcode stats (when compiled with DEVS_VM_OPSTATS)
+static volatile sig_atomic_t opstats_requested;
+static void opstats_signal(int sig) {
+    opstats_requested = 1;
+}
+
+static void poll_opstats(void) {
+    if (opstats_requested) {
+        opstats_requested = 0;
+        devs_vm_opstats_dump(true);
+        flush_dmesg();
+    }
+}
+
 static void run_sample(const char *name, int keepgoing) {
     test_mode = true;
 
@@ -234,6 +304,7 @@ static void run_sample(const char *name, int keepgoing) {
             }
         }
         client_process();
+        poll_opstats();
 
         if (!keepgoing && iter > 15 && !devsmgr_get_ctx() && the_end == 0x1000000000) {
             // if the script ended, we shall exit soon, but not exactly now
@@ -274,6 +345,7 @@ int main(int argc, const char **argv) {
     int enable_lstore = 0;
     int websock = 0;
     int test_settings = 0;
+    const char *aot_file = NULL;
 
     for (int i = 1; i < argc; ++i) {
         const char *arg = argv[i];
@@ -290,6 +362,13 @@ int main(int argc, const char **argv) {
             enable_lstore = 1;
         } else if (strcmp(arg, "-X") == 0) {
             devs_set_global_flags(DEVS_FLAG_GC_STRESS);
+        } else if (strcmp(arg, "-B") == 0) {
+            devs_set_global_flags(DEVS_FLAG_VM_STATS);
+        } else if (strncmp(arg, "-P:", 3) == 0) {
+            profile_file = arg + 3;
+            devs_set_global_flags(DEVS_FLAG_PROFILE);
+        } else if (strncmp(arg, "-A:", 3) == 0) {
+            aot_file = arg + 3;
         } else if (strcmp(arg, "-w") == 0) {
             websock = 1;
         } else if (strcmp(arg, "-n") == 0) {
@@ -306,6 +385,14 @@ int main(int argc, const char **argv) {
         }
     }
 
+    if (aot_file) {
+        if (!devs_img) {
+            fprintf(stderr, "need image for -A\n");
+            return 1;
+        }
+        return write_aot(devs_img, aot_file);
+    }
+
     if (test_settings) {
         flash_init();
         jd_settings_test();
@@ -344,12 +431,15 @@ int main(int argc, const char **argv) {
     }
 
     jd_client_subscribe(client_event_handler, NULL);
+    signal(SIGUSR1, opstats_signal);
 
     if (devs_img) {
         run_sample(devs_img, websock);
     } else {
-        for (;;)
+        for (;;) {
             client_process();
+            poll_opstats();
+        }
     }
 
     return 0;
@@ -0,0 +1,24 @@
+#!/bin/sh
+
+# Compare per-opcode cost of the switch/table and the threaded interpreter loops,
+# and of the threaded loop without int32 arithmetic fast paths ("noint").
+# Usage (from repo root): runtime/scripts/vm-bench.sh [program.ts]
+# For integer loops use devs/samples/bench-int.ts
+# No reference numbers are kept in the tree; to compare a VM change, run this on the
+# same host before and after it and compare the "vm-stats:" ns/op lines.
+
+set -e
+cd "$(dirname "$0")/../.."
+
+PROG=${1:-devs/run-tests/all.ts}
+IMG=.devicescript/bin/crun.devs
+
+make -C runtime bench
+# compiles $PROG into $IMG (and runs it once with the default build)
+./cli/devicescript crun --lazy-gc "$PROG" > /dev/null
+
+for v in switch threaded noint; do
+    for i in 1 2 3; do
+        ./runtime/built/bench-$v/jdcli -n -B $IMG | grep "vm-stats:\|gc-stats:\|bench-" || true
+    done
+done